@@ -0,0 +1,271 @@
+#include "Bitboard.h"
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+size_t Bitboard::ctz(uint64_t bits) {
+#if defined(_MSC_VER)
+    unsigned long indx;
+    _BitScanForward64(&indx, bits);
+    return indx;
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+size_t Bitboard::clz(uint64_t bits) {
+#if defined(_MSC_VER)
+    unsigned long indx;
+    _BitScanReverse64(&indx, bits);
+    return 63 - indx;
+#else
+    return __builtin_clzll(bits);
+#endif
+}
+
+Bitboard::Bitboard(AllocStats* stats) : width(0), height(0), row_words(0), stride(2), words(CountingAllocator<uint64_t>(stats)) {}
+
+void Bitboard::resize(size_t width, size_t height) {
+    this->width = width;
+    this->height = height;
+    row_words = (width + 63) / 64;
+    stride = row_words + 2;
+    words.assign((height + 2) * stride, 0);
+}
+
+void Bitboard::clear() {
+    std::fill(words.begin(), words.end(), 0);
+}
+
+void Bitboard::clear_rows(const RowRange& rows) {
+    if (rows.empty()) return;
+
+    std::fill(words.begin() + (rows.first + 1) * stride, words.begin() + (rows.last + 2) * stride, 0);
+}
+
+size_t Bitboard::get_width() const {
+    return width;
+}
+
+size_t Bitboard::get_height() const {
+    return height;
+}
+
+size_t Bitboard::get_row_words() const {
+    return row_words;
+}
+
+void Bitboard::clear_words(const WordList& list) {
+    for (size_t i = 0; i < list.size(); i++) {
+        words[list[i]] = 0;
+    }
+}
+
+void Bitboard::sort_words(WordList& list) {
+    std::sort(list.begin(), list.end());
+    list.erase(std::unique(list.begin(), list.end()), list.end());
+}
+
+#if defined(__AVX2__)
+// Same as the scalar reach() for the 4 words from o: bits &= mask & ~block, out |= bits, and the words of out that
+// become non-zero are listed.
+static void reach4(size_t o, __m256i bits, const uint64_t* mask, const uint64_t* block, uint64_t* out, WordList& out_words) {
+    bits = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i*)(block + o)),
+        _mm256_and_si256(bits, _mm256_loadu_si256((const __m256i*)(mask + o))));
+    __m256i zero = _mm256_setzero_si256();
+    if (_mm256_testz_si256(bits, bits)) return;
+
+    __m256i old = _mm256_loadu_si256((const __m256i*)(out + o));
+    _mm256_storeu_si256((__m256i*)(out + o), _mm256_or_si256(old, bits));
+
+    int fresh = _mm256_movemask_pd(_mm256_castsi256_pd(
+        _mm256_andnot_si256(_mm256_cmpeq_epi64(bits, zero), _mm256_cmpeq_epi64(old, zero))));
+    for (size_t k = 0; k < 4; k++) {
+        if ((fresh >> k) & 1) out_words.push_back(uint32_t(o + k));
+    }
+}
+#endif
+
+void Bitboard::expand(const WordList& list, const Bitboard& mask, const Bitboard& block, Bitboard& out, WordList& out_words) const {
+    // всяка дума на вълната стига до себе си, до съседните в реда (през пренос на крайния бит) и до горната и долната
+    auto reach = [&](size_t o, uint64_t bits) {
+        bits &= mask.words[o] & ~block.words[o];
+        if (bits == 0) return;
+        if (out.words[o] == 0) out_words.push_back(uint32_t(o));
+        out.words[o] |= bits;
+    };
+
+    for (size_t i = 0; i < list.size(); i++) {
+        size_t o = list[i];
+
+#if defined(__AVX2__)
+        // четири поредни думи от списъка наведнъж - целите на всяка посока също са четири поредни думи
+        if (i + 4 <= list.size() && list[i + 3] == o + 3 && list[i + 1] == o + 1 && list[i + 2] == o + 2) {
+            __m256i w = _mm256_loadu_si256((const __m256i*)&words[o]);
+            if (!_mm256_testz_si256(w, w)) {
+                const uint64_t* m = mask.words.data();
+                const uint64_t* b = block.words.data();
+                uint64_t* to = out.words.data();
+                reach4(o, _mm256_or_si256(_mm256_slli_epi64(w, 1), _mm256_srli_epi64(w, 1)), m, b, to, out_words);
+                reach4(o - 1, _mm256_slli_epi64(w, 63), m, b, to, out_words);
+                reach4(o + 1, _mm256_srli_epi64(w, 63), m, b, to, out_words);
+                reach4(o - stride, w, m, b, to, out_words);
+                reach4(o + stride, w, m, b, to, out_words);
+            }
+            i += 3;
+            continue;
+        }
+#endif
+
+        uint64_t w = words[o];
+        if (w == 0) continue;
+
+        reach(o, (w << 1) | (w >> 1));
+        reach(o - 1, w << 63);
+        reach(o + 1, w >> 63);
+        reach(o - stride, w);
+        reach(o + stride, w);
+    }
+}
+
+size_t Bitboard::next_in_row(size_t r, size_t c, size_t last) const {
+    const uint64_t* w = row(r);
+    size_t from = c + 1;
+    for (size_t i = from / 64; i <= last / 64; i++) {
+        uint64_t bits = w[i];
+        if (i == from / 64) bits &= ~uint64_t(0) << (from % 64);
+        if (bits != 0) return std::min(i * 64 + ctz(bits), last);
+    }
+    return last;
+}
+
+size_t Bitboard::prev_in_row(size_t r, size_t c, size_t first) const {
+    const uint64_t* w = row(r);
+    for (size_t i = c / 64 + 1; i-- > first / 64;) {
+        uint64_t bits = w[i];
+        if (i == c / 64) bits &= (uint64_t(1) << (c % 64)) - 1;
+        if (bits != 0) return std::max(i * 64 + 63 - clz(bits), first);
+    }
+    return first;
+}
+
+bool Bitboard::intersects(const WordList& list, const Bitboard& other) const {
+    for (size_t i = 0; i < list.size(); i++) {
+        if (words[list[i]] & other.words[list[i]]) return true;
+    }
+    return false;
+}
+
+void Bitboard::unite(const Bitboard& other, const WordList& list) {
+    for (size_t i = 0; i < list.size(); i++) {
+        words[list[i]] |= other.words[list[i]];
+    }
+}
+
+void Bitboard::unite(const Bitboard& other) {
+    for (size_t i = 0; i < words.size(); i++) {
+        words[i] |= other.words[i];
+    }
+}
+
+void Bitboard::move_to(const WordList& list, const Bitboard& mask, const Bitboard& block, Bitboard& to, WordList& to_words) {
+    for (size_t i = 0; i < list.size(); i++) {
+        size_t o = list[i];
+        uint64_t moved = words[o] & mask.words[o];
+        if (moved == 0) continue;
+
+        words[o] &= ~moved;
+        moved &= ~block.words[o];
+        if (moved == 0) continue;
+        if (to.words[o] == 0) to_words.push_back(uint32_t(o));
+        to.words[o] |= moved;
+    }
+}
+
+// Bit i of the result is bit 63 - i of bits.
+static uint64_t reverse_bits(uint64_t bits) {
+    bits = ((bits >> 1) & 0x5555555555555555ull) | ((bits & 0x5555555555555555ull) << 1);
+    bits = ((bits >> 2) & 0x3333333333333333ull) | ((bits & 0x3333333333333333ull) << 2);
+    bits = ((bits >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((bits & 0x0F0F0F0F0F0F0F0Full) << 4);
+    bits = ((bits >> 8) & 0x00FF00FF00FF00FFull) | ((bits & 0x00FF00FF00FF00FFull) << 8);
+    bits = ((bits >> 16) & 0x0000FFFF0000FFFFull) | ((bits & 0x0000FFFF0000FFFFull) << 16);
+    return (bits >> 32) | (bits << 32);
+}
+
+// Fills towards the high bits: bit i of links joins bit i - 1 and bit i, carry is bit -1. The seeds shifted over
+// a link are added to the links, so the carry runs through the whole chain of links above each of them.
+static uint64_t fill_up(uint64_t seeds, uint64_t links, uint64_t carry) {
+    uint64_t first = ((seeds << 1) | carry) & links;
+    return seeds | first | (((links + first) ^ links) & links);
+}
+
+void Bitboard::flood(const Bitboard& right, const Bitboard& down, RowRange& rows) {
+    if (rows.empty()) return;
+
+    // редуваме посоката на обхождане на редовете, за да се разпространява бързо и нагоре, и надолу
+    bool changed = true;
+    bool downwards = true;
+    while (changed) {
+        changed = false;
+
+        size_t first = rows.first == 0 ? 0 : rows.first - 1;
+        size_t last = std::min(rows.last + 1, height - 1);
+
+        for (size_t k = 0; k <= last - first; k++) {
+            size_t r = downwards ? first + k : last - k;
+
+            uint64_t* curr = row(r);
+            const uint64_t* above = curr - stride;
+            const uint64_t* below = curr + stride;
+            const uint64_t* rt = right.row(r);
+            const uint64_t* dn = down.row(r);
+            const uint64_t* dn_above = dn - stride;
+
+            bool row_changed = false;
+            for (size_t i = 0; i < row_words; i++) {
+                uint64_t add = ((below[i] & dn[i]) | (above[i] & dn_above[i])) & ~curr[i];
+                if (add) {
+                    curr[i] |= add;
+                    row_changed = true;
+                }
+            }
+
+            // запълваме цели отсечки по реда - нагоре по битовете с пренос, после надолу със същото върху обърнатите думи
+            for (size_t i = 0; i < row_words; i++) {
+                uint64_t carry = (curr[i - 1] >> 63) & (rt[i - 1] >> 63);
+                if (curr[i] == 0 && carry == 0) continue;
+
+                uint64_t links = (rt[i] << 1) | (rt[i - 1] >> 63);
+                uint64_t filled = fill_up(curr[i], links, carry);
+                if (filled != curr[i]) {
+                    curr[i] = filled;
+                    row_changed = true;
+                }
+            }
+            for (size_t i = row_words; i-- > 0;) {
+                uint64_t carry = curr[i + 1] & 1;
+                if (curr[i] == 0 && carry == 0) continue;
+
+                uint64_t filled = reverse_bits(fill_up(reverse_bits(curr[i]), reverse_bits(rt[i]), carry));
+                if (filled != curr[i]) {
+                    curr[i] = filled;
+                    row_changed = true;
+                }
+            }
+
+            if (row_changed) {
+                rows.add(r);
+                changed = true;
+            }
+        }
+
+        downwards = !downwards;
+    }
+}
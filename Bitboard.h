@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Pool.h"
+
+// Range of rows that may contain set bits. Empty if first > last.
+struct RowRange {
+    size_t first;
+    size_t last;
+
+    RowRange() : first(1), last(0) {}
+
+    RowRange(size_t first, size_t last) : first(first), last(last) {}
+
+    bool empty() const {
+        return first > last;
+    }
+
+    void add(size_t row) {
+        if (empty()) {
+            first = last = row;
+        }
+        else {
+            if (row < first) first = row;
+            if (row > last) last = row;
+        }
+    }
+
+    void add(const RowRange& r) {
+        if (r.empty()) return;
+        add(r.first);
+        add(r.last);
+    }
+};
+
+// Offsets of the words of a bitboard that may have set bits, so a sparse wavefront is processed word by word
+// instead of row by row. A word may be listed more than once.
+typedef PoolVector<uint32_t> WordList;
+
+// One bit per pixel, 64 pixels per word, bit i of a word is column (word * 64 + i).
+// Every row has a zero guard word on both sides and the board has a zero guard row above and below,
+// so neighbours can be read without bound checks.
+class Bitboard {
+private:
+    size_t width, height;
+    size_t row_words;
+    size_t stride;
+    PoolVector<uint64_t> words;
+
+public:
+    Bitboard(AllocStats* stats = nullptr);
+
+    // changes the size and clears the board, keeps the memory if it's big enough
+    void resize(size_t width, size_t height);
+
+    void clear();
+
+    void clear_rows(const RowRange& rows);
+
+    void clear_words(const WordList& list);
+
+    size_t get_width() const;
+
+    size_t get_height() const;
+
+    size_t get_row_words() const;
+
+    // offset of the word with pixel (r, c), as kept in a WordList
+    uint32_t word_at(size_t r, size_t c) const {
+        return uint32_t((r + 1) * stride + 1 + c / 64);
+    }
+
+    uint64_t* row(size_t r) {
+        return &words[(r + 1) * stride + 1];
+    }
+
+    const uint64_t* row(size_t r) const {
+        return &words[(r + 1) * stride + 1];
+    }
+
+    bool test(size_t r, size_t c) const {
+        return (row(r)[c / 64] >> (c % 64)) & 1;
+    }
+
+    void set(size_t r, size_t c) {
+        row(r)[c / 64] |= uint64_t(1) << (c % 64);
+    }
+
+    void reset(size_t r, size_t c) {
+        row(r)[c / 64] &= ~(uint64_t(1) << (c % 64));
+    }
+
+    // out = (4-neighbours of the bits in list) & mask & ~block
+    // Writes only words next to the ones in list and adds to out_words the words of out that become non-zero.
+    // With AVX2 four consecutive words of list are expanded at once.
+    void expand(const WordList& list, const Bitboard& mask, const Bitboard& block, Bitboard& out, WordList& out_words) const;
+
+    // first set bit in row r after column c and not after last, last if there is none
+    size_t next_in_row(size_t r, size_t c, size_t last) const;
+
+    // last set bit in row r before column c and not before first, first if there is none
+    size_t prev_in_row(size_t r, size_t c, size_t first) const;
+
+    bool intersects(const WordList& list, const Bitboard& other) const;
+
+    // this |= other, other is empty outside the words in list
+    void unite(const Bitboard& other, const WordList& list);
+
+    // this |= other
+    void unite(const Bitboard& other);
+
+    // Moves the bits in mask from this board to to, except the ones in block, which are only dropped.
+    // Adds to to_words the words of to that become non-zero.
+    void move_to(const WordList& list, const Bitboard& mask, const Bitboard& block, Bitboard& to, WordList& to_words);
+
+    // Adds to the board every pixel connected to it through the edges in right (pixel - its right neighbour)
+    // and down (pixel - its down neighbour). rows must cover the set bits and is extended with the new ones.
+    void flood(const Bitboard& right, const Bitboard& down, RowRange& rows);
+
+    // calls f(row, col) for every set bit in r
+    template<class F>
+    void for_each_in_row(size_t r, F f) const {
+        const uint64_t* w = row(r);
+        for (size_t i = 0; i < row_words; i++) {
+            uint64_t bits = w[i];
+            while (bits != 0) {
+                f(r, i * 64 + ctz(bits));
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    // calls f(row, col) for every set bit in rows
+    template<class F>
+    void for_each(const RowRange& rows, F f) const {
+        if (rows.empty()) return;
+
+        for (size_t r = rows.first; r <= rows.last; r++) {
+            for_each_in_row(r, f);
+        }
+    }
+
+    // calls f(row, col) for every set bit in the words in list, in the order of list
+    template<class F>
+    void for_each(const WordList& list, F f) const {
+        for (size_t i = 0; i < list.size(); i++) {
+            size_t r = list[i] / stride - 1;
+            size_t c = (list[i] % stride - 1) * 64;
+            uint64_t bits = words[list[i]];
+            while (bits != 0) {
+                f(r, c + ctz(bits));
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    // sorts list by row and column and drops the repeated words
+    static void sort_words(WordList& list);
+
+    static size_t ctz(uint64_t bits);
+
+    static size_t clz(uint64_t bits);
+};
@@ -123,9 +123,13 @@ void Bitmap_Image::load_file(const std::string& filename) {
 }
 
 bool Bitmap_Image::save_file() {
+    return save_file(get_name().append("_res.bmp"));
+}
+
+bool Bitmap_Image::save_file(const std::string& filename) {
     std::cout << "Saving file...";
 
-    std::ofstream bmp_file(get_name().append("_res.bmp"), std::ios::trunc | std::ios::binary);
+    std::ofstream bmp_file(filename, std::ios::trunc | std::ios::binary);
 
     if (!bmp_file) return false;
 
@@ -141,5 +141,8 @@ public:
 
     void load_file(const std::string& filename);
 
+    // saves as <name>_res.bmp
     bool save_file();
+
+    bool save_file(const std::string& filename);
 };
\ No newline at end of file
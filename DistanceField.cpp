@@ -0,0 +1,173 @@
+#include "DistanceField.h"
+
+#include <fstream>
+
+const uint32_t DistanceField::NO_SLOT;
+const uint32_t DistanceField::UNREACHABLE;
+
+static void write_word(std::ostream& out, uint32_t word) {
+    for (size_t i = 0; i < 4; i++) {
+        out.put(char((word >> (8 * i)) & 0xFF));
+    }
+}
+
+static bool read_word(std::istream& in, uint32_t& word) {
+    unsigned char bytes[4];
+    if (!in.read((char*)bytes, sizeof(bytes))) return false;
+
+    word = bytes[0] | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+    return true;
+}
+
+void DistanceField::PackedValues::pack(const uint32_t* values, size_t count, bool unreachable) {
+    uint32_t max_value = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!(unreachable && values[i] == UNREACHABLE) && values[i] > max_value) max_value = values[i];
+    }
+
+    // с unreachable стойността от само единици трябва да остане свободна
+    this->unreachable = unreachable;
+    bytes = 1;
+    while (bytes < 4 && (max_value > (UINT32_MAX >> (32 - 8 * bytes)) ||
+        (unreachable && max_value == (UINT32_MAX >> (32 - 8 * bytes)))))
+    {
+        bytes++;
+    }
+
+    data.resize(count * bytes);
+    for (size_t i = 0; i < count; i++) {
+        for (size_t b = 0; b < bytes; b++) {
+            data[i * bytes + b] = (unsigned char)(values[i] >> (8 * b));
+        }
+    }
+}
+
+void DistanceField::resize(size_t width, size_t height, size_t layers) {
+    this->width = width;
+    this->height = height;
+    this->layers = layers;
+    slots.assign(layers, NO_SLOT);
+    stored_sets.clear();
+    stored.clear();
+    step_costs = PackedValues();
+    step_costs.data.assign(width * height, 0);
+}
+
+size_t DistanceField::get_width() const {
+    return width;
+}
+
+size_t DistanceField::get_height() const {
+    return height;
+}
+
+size_t DistanceField::get_layers() const {
+    return layers;
+}
+
+size_t DistanceField::get_stored_layers() const {
+    return stored.size();
+}
+
+bool DistanceField::has_layer(size_t layer) const {
+    return slots[layer] != NO_SLOT;
+}
+
+size_t DistanceField::get_bytes() const {
+    size_t bytes = step_costs.data.size();
+    for (std::vector<PackedValues>::const_iterator it = stored.begin(); it != stored.end(); it++) {
+        bytes += it->data.size();
+    }
+    return bytes;
+}
+
+void DistanceField::set_layer(size_t layer, const uint32_t* dists) {
+    if (slots[layer] == NO_SLOT) {
+        slots[layer] = (uint32_t)stored.size();
+        stored_sets.push_back((uint32_t)layer);
+        stored.push_back(PackedValues());
+    }
+    stored[slots[layer]].pack(dists, width * height, true);
+}
+
+void DistanceField::set_step_costs(const uint32_t* costs) {
+    step_costs.pack(costs, width * height, false);
+}
+
+bool DistanceField::save(const std::string& filename) const {
+    std::ofstream file(filename, std::ios::trunc | std::ios::binary);
+
+    if (!file) return false;
+
+    write_word(file, FILE_SIGNATURE);
+    write_word(file, (uint32_t)width);
+    write_word(file, (uint32_t)height);
+    write_word(file, (uint32_t)layers);
+    write_word(file, (uint32_t)stored.size());
+
+    write_word(file, (uint32_t)step_costs.bytes);
+    file.write((const char*)step_costs.data.data(), step_costs.data.size());
+    for (size_t i = 0; i < stored.size(); i++) {
+        write_word(file, stored_sets[i]);
+        write_word(file, (uint32_t)stored[i].bytes);
+        file.write((const char*)stored[i].data.data(), stored[i].data.size());
+    }
+
+    return (bool)file;
+}
+
+bool DistanceField::load(const std::string& filename, size_t width, size_t height, size_t layers) {
+    std::ifstream file(filename, std::ios::binary);
+
+    if (!file) return false;
+
+    uint32_t header[5];
+    for (size_t i = 0; i < 5; i++) {
+        if (!read_word(file, header[i])) return false;
+    }
+    if (header[0] != FILE_SIGNATURE || header[1] != width || header[2] != height || header[3] != layers ||
+        header[4] > layers)
+    {
+        return false;
+    }
+
+    // всички стойности трябва да се съдържат в останалата част на файла
+    std::streampos pos = file.tellg();
+    file.seekg(0, std::ios::end);
+    uint64_t left = uint64_t(file.tellg() - pos);
+    file.seekg(pos);
+
+    uint64_t count = uint64_t(width) * height;
+    auto fits = [&](uint32_t bytes) {
+        if (bytes < 1 || bytes > 4 || left / bytes < count) return false;
+        left -= count * bytes;
+        return true;
+    };
+
+    resize(width, height, layers);
+
+    uint32_t bytes;
+    if (left < 4 || !read_word(file, bytes)) return false;
+    left -= 4;
+    if (!fits(bytes)) return false;
+    step_costs.bytes = bytes;
+    step_costs.data.resize(count * bytes);
+    file.read((char*)step_costs.data.data(), step_costs.data.size());
+
+    for (uint32_t i = 0; i < header[4]; i++) {
+        uint32_t layer;
+        if (left < 8 || !read_word(file, layer) || !read_word(file, bytes)) return false;
+        left -= 8;
+        if (layer >= layers || slots[layer] != NO_SLOT || !fits(bytes)) return false;
+
+        slots[layer] = (uint32_t)stored.size();
+        stored_sets.push_back(layer);
+        stored.push_back(PackedValues());
+        stored.back().bytes = bytes;
+        stored.back().unreachable = true;
+        stored.back().data.resize(count * bytes);
+        file.read((char*)stored.back().data.data(), stored.back().data.size());
+    }
+
+    return (bool)file;
+}
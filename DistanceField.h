@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Cost to reach an exit from every pixel under every key set. Layer s is the key set with bit k set for key k.
+// Only the key sets some walk through the maze can hold are stored, the others read as unreachable.
+// Also keeps the cost of stepping into every pixel, so a path can be followed down the field without the cost model.
+class DistanceField {
+private:
+    static const uint32_t FILE_SIGNATURE = 0x3246444D; // "MDF2"
+    static const uint32_t NO_SLOT = UINT32_MAX;
+
+    // Values in the fewest bytes (1 to 4, little-endian) that fit them. With unreachable the all-ones value of
+    // that width is kept free and stands for UNREACHABLE.
+    struct PackedValues {
+        size_t bytes;
+        bool unreachable;
+        std::vector<unsigned char> data;
+
+        PackedValues() : bytes(1), unreachable(false) {}
+
+        void pack(const uint32_t* values, size_t count, bool unreachable);
+
+        uint32_t get(size_t indx) const {
+            const unsigned char* p = &data[indx * bytes];
+            uint32_t value = p[0];
+            for (size_t i = 1; i < bytes; i++) {
+                value |= uint32_t(p[i]) << (8 * i);
+            }
+            return unreachable && value == (UINT32_MAX >> (32 - 8 * bytes)) ? UNREACHABLE : value;
+        }
+    };
+
+    size_t width, height, layers;
+    std::vector<uint32_t> slots; // key set -> its stored layer, NO_SLOT if it isn't stored
+    std::vector<uint32_t> stored_sets; // stored layer -> key set
+    std::vector<PackedValues> stored;
+    PackedValues step_costs;
+
+public:
+    static const uint32_t UNREACHABLE = UINT32_MAX;
+
+    DistanceField() : width(0), height(0), layers(0) {}
+
+    // changes the size and drops the stored layers, so every state is unreachable
+    void resize(size_t width, size_t height, size_t layers);
+
+    size_t get_width() const;
+
+    size_t get_height() const;
+
+    size_t get_layers() const;
+
+    size_t get_stored_layers() const;
+
+    bool has_layer(size_t layer) const;
+
+    // bytes held by the distances and the step costs
+    size_t get_bytes() const;
+
+    uint32_t dist(size_t layer, size_t indx) const {
+        uint32_t slot = slots[layer];
+        return slot == NO_SLOT ? UNREACHABLE : stored[slot].get(indx);
+    }
+
+    // stores the distances of a key set, width * height of them, replacing the ones it had
+    void set_layer(size_t layer, const uint32_t* dists);
+
+    uint32_t step_cost(size_t indx) const {
+        return step_costs.get(indx);
+    }
+
+    // width * height of them, 0 for walls
+    void set_step_costs(const uint32_t* costs);
+
+    // binary file: signature, width, height, layers, stored layers, then the step costs and every stored layer
+    // as its key set (not for the costs), byte width and values (all little-endian, the header as uint32)
+    bool save(const std::string& filename) const;
+
+    // Only a field of the given size is read. The sizes in the file are checked against the bytes it holds, so a
+    // damaged file is rejected before anything is allocated for it.
+    bool load(const std::string& filename, size_t width, size_t height, size_t layers);
+};
@@ -1,10 +1,158 @@
 ﻿#include "Maze.h"
 
+#include <limits>
+
 const Maze::Color Maze::WALL_COLOR = Maze::Color(0, 0, 0);
 const Maze::Color Maze::START_COLOR = Maze::Color(195, 195, 196);
 const Maze::Color Maze::END_COLOR = Maze::Color(126, 127, 127);
 const Maze::Color Maze::PATH_COLOR = Maze::Color(255, 0, 0);
 const Maze::KeyCombination Maze::START_KEY_COMB = Maze::KeyCombination();
+const size_t Maze::MAX_DIST;
+const size_t Maze::NO_LAYER;
+const size_t Maze::MAX_FIELD_KEYS;
+const size_t Maze::MAX_PARALLEL_KEYS;
+const size_t Maze::MAX_CLUSTER_KEYS;
+const size_t Maze::DEFAULT_CLUSTER_SIZE;
+const size_t Maze::BITS_SHARE;
+const uint32_t Maze::NO_CELL;
+const uint32_t Maze::NO_RECT;
+const uint64_t Maze::NO_PARENT;
+const size_t Maze::SearchLimits::CHECK_INTERVAL;
+const size_t Maze::BatchResult::NO_PATH;
+
+Maze::Workspace::Workspace() :
+    loads(0),
+    epoch(1),
+    pass(0),
+    pixel_count(0),
+    bgr(CountingAllocator<unsigned char>(&stats)),
+    types(CountingAllocator<PixelType>(&stats)),
+    layers(CountingAllocator<Layer>(&stats)),
+    wave(&stats),
+    same_right(&stats),
+    same_down(&stats),
+    area(&stats),
+    ends_seen(&stats),
+    base_mask(&stats),
+    key_masks(CountingAllocator<Bitboard>(&stats)),
+    zone_masks(CountingAllocator<Bitboard>(&stats)),
+    heap(CountingAllocator<std::pair<size_t, size_t>>(&stats)),
+    pixel_keys(CountingAllocator<size_t>(&stats)),
+    field_dists(CountingAllocator<uint32_t>(&stats)),
+    field_marks(CountingAllocator<uint32_t>(&stats)),
+    open(CountingAllocator<OpenState>(&stats)),
+    incons(CountingAllocator<State>(&stats)),
+    end_boxes(CountingAllocator<std::pair<Coord, Coord>>(&stats)),
+    row_steps(CountingAllocator<size_t>(&stats)),
+    col_steps(CountingAllocator<size_t>(&stats)),
+    batch_targets(&stats),
+    batch_layers(CountingAllocator<Layer>(&stats)),
+    batch_ends_seen(&stats),
+    batch_epoch(1),
+    cluster_dists(CountingAllocator<size_t>(&stats)),
+    cluster_parents(CountingAllocator<uint32_t>(&stats)),
+    hierarchy_steps(CountingAllocator<HierarchyStep>(&stats)),
+    node_steps(CountingAllocator<size_t>(&stats)),
+    hierarchy_open(CountingAllocator<std::pair<size_t, size_t>>(&stats)),
+    rects(CountingAllocator<Rect>(&stats)),
+    rect_of(CountingAllocator<uint32_t>(&stats)),
+    stops(&stats),
+    stops_t(&stats),
+    corridors(&stats) {}
+
+void Maze::Workspace::reset() {
+    stats.reset();
+    new_search();
+}
+
+void Maze::Workspace::set_huge_pages(bool huge_pages) {
+    stats.huge_pages = huge_pages;
+}
+
+const AllocStats& Maze::Workspace::get_stats() const {
+    return stats;
+}
+
+void Maze::Workspace::new_search() {
+    wave.clear();
+    epoch++;
+
+    // при препълване старите печати стават валидни отново, затова ги нулираме
+    if (epoch == 0) {
+        for (PoolVector<Layer>::iterator it = layers.begin(); it != layers.end(); it++) {
+            it->stamps.clear();
+            it->bits_epoch = 0;
+        }
+        epoch = 1;
+    }
+}
+
+Maze::Workspace::Layer& Maze::Workspace::layer_at(size_t layer) {
+    while (layers.size() <= layer) {
+        layers.emplace_back(&stats);
+    }
+
+    Layer& l = layers[layer];
+    if (l.dists.size() < pixel_count) {
+        l.dists.resize(pixel_count);
+        l.stamps.resize(pixel_count);
+    }
+    return l;
+}
+
+size_t Maze::Workspace::get_dist(size_t layer, size_t indx) const {
+    if (layer >= layers.size() || !layers[layer].stamps.test(indx, epoch)) {
+        return MAX_DIST;
+    }
+    return layers[layer].dists[indx];
+}
+
+void Maze::Workspace::set_dist(size_t layer, size_t indx, size_t dist) {
+    Layer& l = layer_at(layer);
+    l.dists[indx] = dist;
+    l.stamps.set(indx, epoch);
+}
+
+uint64_t Maze::Workspace::get_parent(size_t layer, size_t indx) const {
+    return layers[layer].parents[indx];
+}
+
+void Maze::Workspace::set_parent(size_t layer, size_t indx, uint64_t parent) {
+    Layer& l = layer_at(layer);
+    if (l.parents.size() < pixel_count) {
+        l.parents.resize(pixel_count);
+    }
+    l.parents[indx] = parent;
+}
+
+void Maze::Workspace::swap_batch_state() {
+    layers.swap(batch_layers);
+    std::swap(ends_seen, batch_ends_seen);
+    std::swap(epoch, batch_epoch);
+}
+
+void Maze::Workspace::new_pass() {
+    pass++;
+
+    if (pass == 0) {
+        for (PoolVector<Layer>::iterator it = layers.begin(); it != layers.end(); it++) {
+            it->closed.clear();
+        }
+        pass = 1;
+    }
+}
+
+bool Maze::Workspace::is_closed(size_t layer, size_t indx) const {
+    return layer < layers.size() && layers[layer].closed.test(indx, pass);
+}
+
+void Maze::Workspace::close(size_t layer, size_t indx) {
+    Layer& l = layer_at(layer);
+    if (l.closed.size() < pixel_count) {
+        l.closed.resize(pixel_count);
+    }
+    l.closed.set(indx, pass);
+}
 
 bool Maze::is_valid(const Coord& c) const {
     return c.row < height&& c.col < width;
@@ -14,29 +162,48 @@ size_t Maze::pixel_indx(const Coord& c) const {
     if (!is_valid(c)) {
         throw MazeException("ERROR: Coords out of range.");
     }
+
+    if (layout == Layout::TILED) {
+        size_t tile = (c.row >> TILE_SHIFT) * tile_cols + (c.col >> TILE_SHIFT);
+        return (tile << (2 * TILE_SHIFT)) | ((c.row & TILE_MASK) << TILE_SHIFT) | (c.col & TILE_MASK);
+    }
+    return c.row * width + c.col;
+}
+
+Maze::Coord Maze::coord_at(size_t indx) const {
+    if (layout == Layout::TILED) {
+        size_t tile = indx >> (2 * TILE_SHIFT);
+        return Coord(((tile / tile_cols) << TILE_SHIFT) | ((indx >> TILE_SHIFT) & TILE_MASK),
+            ((tile % tile_cols) << TILE_SHIFT) | (indx & TILE_MASK));
+    }
+    return Coord(indx / width, indx % width);
+}
+
+size_t Maze::field_indx(const Coord& c) const {
+    if (!is_valid(c)) {
+        throw MazeException("ERROR: Coords out of range.");
+    }
     return c.row * width + c.col;
 }
 
-Maze::Pixel& Maze::pixel_at(const Coord& c) {
-    return pixels[pixel_indx(c)];
+Maze::PixelType& Maze::type_at(const Coord& c) {
+    return types[pixel_indx(c)];
 }
 
-const Maze::Pixel& Maze::pixel_at(const Coord& c) const {
-    return pixels[pixel_indx(c)];
+Maze::PixelType Maze::type_at(const Coord& c) const {
+    return types[pixel_indx(c)];
 }
 
-Maze::Color Maze::bmp_color_at(const Bitmap_Image& bmp_img, const Coord& c) {
+Maze::Color Maze::color_at(const Coord& c) const {
     if (!is_valid(c)) {
         throw MazeException("ERROR: Coords out of range.");
     }
 
-    size_t indx = (c.row * width + c.col) * bmp_img.get_dib_header().bits_per_pixel / 8;
-    const std::vector<unsigned char>& color_table = bmp_img.get_color_table();
-
-    return { color_table[indx + 2], color_table[indx + 1], color_table[indx] };
+    const unsigned char* bgr = pixels.data + c.row * pixels.stride + c.col * pixels.pixel_bytes;
+    return { bgr[2], bgr[1], bgr[0] };
 }
 
-void Maze::bmp_set_color_at(Bitmap_Image& bmp_img, const Coord& c, const Color& clr) {
+void Maze::bmp_set_color_at(Bitmap_Image& bmp_img, const Coord& c, const Color& clr) const {
     if (!is_valid(c)) {
         throw MazeException("ERROR: Coords out of range.");
     }
@@ -54,7 +221,7 @@ void Maze::print_pxl(const Coord& c) const {
         throw MazeException("ERROR: Coords out of range.");
     }
 
-    Color clr = pixels[pixel_indx(c)].color;
+    Color clr = color_at(c);
     std::cout << "(" << +clr.red << "," << +clr.green << "," << +clr.blue << ")\n";
 }
 
@@ -74,7 +241,7 @@ Maze::Coord Maze::get_start() const {
     for (size_t i = 0; i < height; i++) {
         for (size_t j = 0; j < width; j++) {
             Coord curr(i, j);
-            if (pixel_at(curr).color == START_COLOR) {
+            if (color_at(curr) == START_COLOR) {
                 return curr;
             }
         }
@@ -84,133 +251,362 @@ Maze::Coord Maze::get_start() const {
 }
 
 void Maze::set_area_at(const Coord& c) {
-    Pixel& pxl = pixel_at(c);
+    Color clr = color_at(c);
 
-    if (pxl.color == WALL_COLOR) {
-        pxl.type = Pixel::Type::WALL;
+    if (clr == WALL_COLOR) {
+        type_at(c) = PixelType::WALL;
     }
-    else if (pxl.color.is_grey()) {
-        pxl.type = Pixel::Type::FREE;
+    else if (clr.is_grey()) {
+        type_at(c) = PixelType::FREE;
     }
     else {
-        Pixel::Type type = Pixel::Type::ZONE;
-        if (pxl.color == START_COLOR) type = Pixel::Type::START;
-        if (pxl.color == END_COLOR) type = Pixel::Type::END;
+        PixelType type = PixelType::ZONE;
+        if (clr == START_COLOR) type = PixelType::START;
+        if (clr == END_COLOR) type = PixelType::END;
 
-        pxl.type = type;
+        // заливаме областта с битове по ръбовете между еднакво оцветени съседи
+        Bitboard& area = ws->area;
+        RowRange rows(c.row, c.row);
+        area.set(c.row, c.col);
+        area.flood(ws->same_right, ws->same_down, rows);
 
-        std::vector<Pixel*> key_pixels;
-        key_pixels.reserve(KEY_HEIGHT * KEY_WIDTH);
+        size_t count = 0;
         size_t max_height, min_height, max_width, min_width;
         max_height = min_height = c.row;
         max_width = min_width = c.col;
 
-        std::queue<Coord> wave;
-        wave.push(c);
-        key_pixels.push_back(&pxl);
-
-        while (!wave.empty()) {
-            Coord curr = wave.front();
-            wave.pop();
-
-            Pixel& curr_pxl = pixel_at(curr);
-
-            for (int i = -1; i < 2; i++) {
-                for (int j = -1; j < 2; j++) {
-                    if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
-
-                    // взимаме съседа на текущия пиксел и го добавяме ако е със същия цвят
-                    Coord nb = curr + Coord(i, j);
-                    try {
-                        Pixel& nb_pxl = pixel_at(nb);
-                        if (nb_pxl.color != curr_pxl.color || nb_pxl.type != Pixel::Type::UNSET) continue;
-
-                        nb_pxl.type = type;
-
-                        wave.push(nb);
-                        if (max_height < nb.row) max_height = nb.row;
-                        if (min_height > nb.row) min_height = nb.row;
-                        if (max_width < nb.col) max_width = nb.col;
-                        if (min_width > nb.col) min_width = nb.col;
-
-                        if (type == Pixel::Type::ZONE &&
-                            max_height - min_height + 1 <= KEY_HEIGHT &&
-                            max_width - min_width + 1 <= KEY_WIDTH &&
-                            key_pixels.size() < KEY_HEIGHT * KEY_WIDTH)
-                        {
-                            key_pixels.push_back(&nb_pxl);
-                        }
-                        else if (key_pixels.size() != 0) {
-                            key_pixels.clear();
-                        }
-                    }
-                    catch (MazeException& e) {
-                        continue;
-                    };
-                }
-            }
-        }
+        area.for_each(rows, [&](size_t row, size_t col) {
+            type_at(Coord(row, col)) = type;
+            count++;
+            if (max_height < row) max_height = row;
+            if (min_height > row) min_height = row;
+            if (max_width < col) max_width = col;
+            if (min_width > col) min_width = col;
+        });
 
-        if (type == Pixel::Type::ZONE &&
+        if (type == PixelType::ZONE &&
             max_height - min_height + 1 == KEY_HEIGHT &&
             max_width - min_width + 1 == KEY_WIDTH &&
-            key_pixels.size() == KEY_HEIGHT * KEY_WIDTH)
+            count == KEY_HEIGHT * KEY_WIDTH)
         {
-            for (std::vector<Pixel*>::iterator it = key_pixels.begin(); it != key_pixels.end(); it++) {
-                (*it)->type = Pixel::Type::KEY;
-            }
+            area.for_each(rows, [&](size_t row, size_t col) {
+                type_at(Coord(row, col)) = PixelType::KEY;
+            });
         }
+
+        area.clear_rows(rows);
     }
 }
 
-Maze::Maze(const Bitmap_Image& bmp_img) {
+Maze::Maze(const Bitmap_Image& bmp_img) :
+    width(0), height(0), pixels_hash(0), requested_layout(Layout::ROW_MAJOR), layout(Layout::ROW_MAJOR), tile_cols(0),
+    output_format(PathFormat::TEXT), types(nullptr), contracted(false), contracted_dists(false), classified(false),
+    masks_built(false), load_id(0), ws(&own_workspace)
+{
     from_bmp(bmp_img);
 }
 
+void Maze::check_workspace() const {
+    // масивите в работната памет вече са на другия лабиринт
+    if (load_id != ws->loads) throw MazeException("ERROR: The workspace holds another maze, load this one again.");
+}
+
+void Maze::begin_solve() {
+    check_workspace();
+    ws->stats.reset();
+}
+
+void Maze::set_layout(Layout layout) {
+    requested_layout = layout;
+}
+
+void Maze::set_output_format(PathFormat format) {
+    output_format = format;
+}
+
+PathFormat Maze::get_output_format() const {
+    return output_format;
+}
+
+Maze::Layout Maze::get_layout() const {
+    return layout;
+}
+
 void Maze::from_bmp(const std::string& filename) {
     from_bmp(Bitmap_Image(filename));
 }
 
 void Maze::from_bmp(const Bitmap_Image& bmp_img) {
+    // the bitmap can go away after loading, so its pixels are copied into the workspace
+    const std::vector<unsigned char>& color_table = bmp_img.get_color_table();
+    ws->bgr.assign(color_table.begin(), color_table.end());
+
+    size_t w = bmp_img.get_dib_header().width;
+    size_t pixel_bytes = bmp_img.get_dib_header().bits_per_pixel / 8;
+    pixels = PixelBuffer(ws->bgr.data(), w, bmp_img.get_dib_header().height, w * pixel_bytes, pixel_bytes);
+    load(nullptr);
+}
+
+void Maze::from_buffer(const PixelBuffer& pixels, PixelType* types) {
+    if (pixels.data == nullptr || pixels.pixel_bytes < 3 || pixels.stride < pixels.width * pixels.pixel_bytes) {
+        throw MazeException("ERROR: Invalid pixel buffer.");
+    }
+
+    this->pixels = pixels;
+    load(types);
+}
+
+void Maze::load(PixelType* pre_classified) {
     ends.clear();
     keys.clear();
     key_combs.clear();
-    pixels.clear();
+    comb_layers.clear();
+    comb_next.clear();
+    contracted = false;
+    contracted_dists = false;
+    classified = false;
+    masks_built = false;
+    hierarchy = Hierarchy();
+    ws->reset();
+    load_id = ++ws->loads;
+
+    width = pixels.width;
+    height = pixels.height;
+
+    // масивът на извикващия е ред по ред, затова с него плочките не се ползват
+    layout = pre_classified != nullptr ? Layout::ROW_MAJOR : requested_layout;
+    tile_cols = (width + TILE_MASK) >> TILE_SHIFT;
+    if (layout == Layout::TILED) {
+        ws->pixel_count = (tile_cols * ((height + TILE_MASK) >> TILE_SHIFT)) << (2 * TILE_SHIFT);
+    }
+    else {
+        ws->pixel_count = width * height;
+    }
+
+    // assign() reuses the capacity left from the previous maze
+    if (pre_classified != nullptr) {
+        types = pre_classified;
+    }
+    else {
+        ws->types.assign(ws->pixel_count, PixelType::UNSET);
+        types = ws->types.data();
+    }
+
+    ws->same_right.resize(width, height);
+    ws->same_down.resize(width, height);
+    ws->area.resize(width, height);
+
+    // хешът е ред по ред и не зависи от подредбата на пикселите в паметта
+    pixels_hash = hash_mix(hash_mix(0, width), height);
+    for (size_t i = 0; i < height; i++) {
+        for (size_t j = 0; j < width; j++) {
+            Color clr = color_at(Coord(i, j));
+            pixels_hash = hash_mix(pixels_hash, (uint64_t(clr.red) << 16) | (uint64_t(clr.green) << 8) | clr.blue);
+
+            if (j > 0 && color_at(Coord(i, j - 1)) == clr) ws->same_right.set(i, j - 1);
+            if (i > 0 && color_at(Coord(i - 1, j)) == clr) ws->same_down.set(i - 1, j);
+        }
+    }
+}
+
+void Maze::begin_search() {
+    ws->new_search();
+    contracted_dists = false;
+    ends.clear();
+    ws->ends_seen.resize(width, height);
+}
+
+size_t Maze::comb_layer(const KeyCombination& key_comb) {
+    std::unordered_map<KeyCombination, size_t, KeyCombination::Hasher>::iterator it = comb_layers.find(key_comb);
+    if (it != comb_layers.end()) return it->second;
+
+    size_t layer = key_combs.size();
+    key_combs.push_back(key_comb);
+    comb_next.push_back(std::vector<size_t>());
+    comb_layers[key_comb] = layer;
+    return layer;
+}
+
+size_t Maze::layer_with_key(size_t layer, size_t key) {
+    if (comb_next[layer].size() <= key) {
+        comb_next[layer].resize(keys.size(), NO_LAYER);
+    }
+
+    if (comb_next[layer][key] == NO_LAYER) {
+        size_t next = comb_layer(key_combs[layer].set_at(key));
+        comb_next[layer][key] = next;
+    }
+    return comb_next[layer][key];
+}
+
+bool Maze::step_to(const Coord& nb, size_t curr_layer, size_t& new_layer) {
+    if (!is_valid(nb)) return false;
+
+    PixelType& nb_type = type_at(nb);
+    if (nb_type == PixelType::UNSET) {
+        set_area_at(nb);
+    }
+
+    // ако е стена я пропускаме
+    if (nb_type == PixelType::WALL) return false;
+
+    // всяка изходна област се записва веднъж - при първото стъпване в нея
+    if (nb_type == PixelType::END && !ws->ends_seen.test(nb.row, nb.col)) {
+        ends.push_back(nb);
+        RowRange end_rows(nb.row, nb.row);
+        ws->ends_seen.set(nb.row, nb.col);
+        ws->ends_seen.flood(ws->same_right, ws->same_down, end_rows);
+    }
+
+    // ако новият пиксел е цветен:
+    //  - ако е ключ - добавяме го (ако вече не е добавен)
+    //	- ако не е ключ - проверяваме дали има ключ с такъв цвят и дали текущата комбинация съдържа този цвят
+    //	  ако не го съдържа - отиваме към следващия съсед
+    //	  ако го съдържа - минаваме през него и изчисляваме новата цена
+    // ако не е цветен -  минаваме през него и изчисляваме новата цена
+    new_layer = curr_layer;
+    if (nb_type == PixelType::KEY) {
+        Color nb_color = color_at(nb);
+        if (keys.find(nb_color) == keys.end()) {
+            size_t pos = keys.size();
+            keys[nb_color] = pos; // keys.size() - 1;
+        }
+
+        new_layer = layer_with_key(curr_layer, keys[nb_color]);
+    }
+    else if (nb_type == PixelType::ZONE) {
+        std::unordered_map<Color, size_t, Color::Hasher>::iterator key = keys.find(color_at(nb));
+        if (key == keys.end()) return false;
+
+        if (!key_combs[curr_layer].has(key->second)) return false;
+    }
+
+    return true;
+}
+
+bool Maze::classify_all(const SearchLimits& limits) {
+    if (classified) return true;
+
+    for (size_t i = 0; i < height; i++) {
+        if (limits.stop()) return false;
+
+        for (size_t j = 0; j < width; j++) {
+            Coord curr(i, j);
+            if (type_at(curr) == PixelType::UNSET) {
+                set_area_at(curr);
+            }
+
+            if (type_at(curr) == PixelType::KEY && keys.find(color_at(curr)) == keys.end()) {
+                size_t pos = keys.size();
+                keys[color_at(curr)] = pos;
+            }
+        }
+    }
+    classified = true;
+    return true;
+}
+
+bool Maze::build_masks(const SearchLimits& limits) {
+    if (masks_built) return true;
 
-    width = bmp_img.get_dib_header().width;
-    height = bmp_img.get_dib_header().height;
+    ws->base_mask.resize(width, height);
 
-    pixels.resize(width * height);
+    while (ws->key_masks.size() < keys.size()) ws->key_masks.emplace_back(&ws->stats);
+    while (ws->zone_masks.size() < keys.size()) ws->zone_masks.emplace_back(&ws->stats);
+    for (size_t k = 0; k < keys.size(); k++) {
+        ws->key_masks[k].resize(width, height);
+        ws->zone_masks[k].resize(width, height);
+    }
 
     for (size_t i = 0; i < height; i++) {
+        if (limits.stop()) return false;
+
         for (size_t j = 0; j < width; j++) {
-            Coord coord = { i, j };
-            pixel_at(coord).color = bmp_color_at(bmp_img, coord);
+            Coord curr(i, j);
+            switch (type_at(curr)) {
+            case PixelType::FREE:
+            case PixelType::START:
+            case PixelType::END:
+                ws->base_mask.set(i, j);
+                break;
+            case PixelType::KEY:
+                ws->key_masks[keys[color_at(curr)]].set(i, j);
+                break;
+            case PixelType::ZONE: {
+                std::unordered_map<Color, size_t, Color::Hasher>::iterator key = keys.find(color_at(curr));
+                if (key != keys.end()) ws->zone_masks[key->second].set(i, j);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+    masks_built = true;
+    return true;
+}
+
+Maze::Workspace::Layer& Maze::bits_layer(size_t layer) {
+    Workspace::Layer& l = ws->layer_at(layer);
+    if (l.bits_epoch == ws->epoch) return l;
+
+    // ключовете са проходими винаги, зоните - само ако комбинацията съдържа ключа им
+    l.passable.resize(width, height);
+    l.new_keys.resize(width, height);
+    l.passable.unite(ws->base_mask);
+    for (size_t k = 0; k < keys.size(); k++) {
+        l.passable.unite(ws->key_masks[k]);
+        if (key_combs[layer].has(k)) {
+            l.passable.unite(ws->zone_masks[k]);
+        }
+        else {
+            l.new_keys.unite(ws->key_masks[k]);
         }
     }
+
+    l.visited.resize(width, height);
+    l.frontier.resize(width, height);
+    l.next.resize(width, height);
+    l.frontier_words.clear();
+    l.next_words.clear();
+    l.bits_epoch = ws->epoch;
+    return l;
+}
+
+uint64_t Maze::get_hash() const {
+    return pixels_hash;
 }
 
 void Maze::find_path() {
+    find_path(GreyCost());
+}
+
+template<class CostModel>
+void Maze::find_path(const CostModel& cost) {
+    begin_solve();
+    find_path(cost, std::integral_constant<bool, CostModel::IS_UNIFORM>());
+}
+
+template<class CostModel>
+void Maze::find_path(const CostModel& cost, std::false_type) {
     Coord start = get_start();
-    set_area_at(start);
-    key_combs.insert(KeyCombination());
-    pixel_at(start).key_dists[key_combs.begin()] = 0;
+    if (type_at(start) == PixelType::UNSET) set_area_at(start);
+    begin_search();
+    size_t start_layer = comb_layer(START_KEY_COMB);
+    ws->set_dist(start_layer, pixel_indx(start), 0);
 
-    using KeyCombIter = std::unordered_set<KeyCombination, KeyCombination::Hasher>::iterator;
-    using CoordComb = std::pair<Coord, KeyCombIter>;
+    using State = Workspace::State;
 
-    std::queue<CoordComb> wave;
-    wave.push(CoordComb(start, key_combs.begin()));
+    RingQueue<State>& wave = ws->wave;
+    wave.push(State(start, start_layer));
 
     while (!wave.empty()) {
-        CoordComb curr = wave.front();
+        State curr = wave.front();
         wave.pop();
 
-        Pixel& pxl = pixel_at(curr.first);
-
         // взимаме дистанцията от текущия пиксел със текущата комбинация от ключове
-        std::unordered_map<KeyCombIter, size_t, Pixel::umap_iterator_hasher>::iterator curr_dist_it = pxl.key_dists.find(curr.second);
-        if (curr_dist_it == pxl.key_dists.end()) {
+        size_t curr_dist = ws->get_dist(curr.layer, pixel_indx(curr.coord));
+        if (curr_dist == MAX_DIST) {
             throw MazeException("ERROR: current pixel doesn't have current combination.");
         }
 
@@ -220,180 +616,2231 @@ void Maze::find_path() {
                 // пропускаме текущия пиксел и диагоналните му съседи
                 if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
 
-                try {
-                    // взимаме съседа на текущия пиксел
-                    Coord nb = curr.first + Coord(i, j);
-                    Pixel& nb_pxl = pixel_at(nb);
-                    if (nb_pxl.type == Pixel::Type::UNSET) {
-                        set_area_at(nb);
-                        if (nb_pxl.type == Pixel::Type::END) {
-                            ends.push_back(nb);
-                        }
-                    }
+                // взимаме съседа на текущия пиксел
+                Coord nb = curr.coord + Coord(i, j);
+                size_t new_layer;
+                if (!step_to(nb, curr.layer, new_layer)) continue;
+
+                // изчисляваме цената за преминаване в съседа
+                size_t weight = cost(color_at(nb));
+                // if(i != 0 && j != 0) weight *= sqrt(2);
+
+                // ако съседния пиксел няма разстояние със новата комбинация или старото такова е по голямо от новото
+                // тогава актуализираме разстоянието
+                size_t nb_indx = pixel_indx(nb);
+                if (ws->get_dist(new_layer, nb_indx) > curr_dist + weight) {
+                    ws->set_dist(new_layer, nb_indx, curr_dist + weight);
+                    wave.push(State(nb, new_layer));
+                }
+            }
+        }
+    }
+}
 
-                    // ако е стена я пропускаме
-                    if (nb_pxl.type == Pixel::Type::WALL) continue;
-
-                    // изчисляваме цената за преминаване в съседа
-                    size_t weight = nb_pxl.color.is_grey() ? nb_pxl.color.red : 1;
-                    // if(i != 0 && j != 0) weight *= sqrt(2);
-
-                    // ако новият пиксел е цветен:
-                    //  - ако е ключ - добавяме го (ако вече не е добавен)
-                    //	- ако не е ключ - проверяваме дали има ключ с такъв цвят и дали текущата комбинация съдържа този цвят
-                    //	  ако не го съдържа - отиваме към следващия съсед
-                    //	  ако го съдържа - минаваме през него и изчисляваме новата цена
-                    // ако не е цветен -  минаваме през него и изчисляваме новата цена
-                    KeyCombIter new_key_comb = curr.second;
-                    if (nb_pxl.type == Pixel::Type::KEY) {
-                        if (keys.find(nb_pxl.color) == keys.end()) {
-                            size_t pos = keys.size();
-                            keys[nb_pxl.color] = pos; // keys.size() - 1;
-                        }
+// Every step costs the same, so the first time a (pixel, key combination) state is reached is the shortest one.
+// The BFS starts with the pixel queue, which classifies only the pixels it reaches. Once it has reached
+// pixel_count / BITS_SHARE states, the search is big enough to pay for classifying the whole maze and building
+// the masks, and it goes on with bitboards from the next level.
+template<class CostModel>
+bool Maze::find_path(const CostModel& cost, std::true_type, const SearchLimits& limits, bool to_first_end) {
+    Coord start = get_start();
+    if (type_at(start) == PixelType::UNSET) set_area_at(start);
+    begin_search();
+    size_t start_layer = comb_layer(START_KEY_COMB);
+    ws->set_dist(start_layer, pixel_indx(start), 0);
 
-                        KeyCombination key_comb = curr.second->set_at(keys[nb_pxl.color]);
-                        new_key_comb = key_combs.insert(key_comb).first;
+    using State = Workspace::State;
 
-                    }
-                    else if (nb_pxl.type == Pixel::Type::ZONE) {
-                        if (keys.find(nb_pxl.color) == keys.end()) continue;
+    RingQueue<State>& wave = ws->wave;
+    wave.push(State(start, start_layer));
 
-                        KeyCombination key_comb = curr.second->set_at(keys[nb_pxl.color]);
-                        if (*curr.second != key_comb) continue;
-                    }
+    size_t reached = 1;
+    for (size_t level = 0; !wave.empty(); level++) {
+        if (limits.stop()) return false;
+        if (to_first_end && !ends.empty()) return true;
 
-                    // ако съседния пиксел няма разстояние със новата комбинация или старото такова е по голямо от новото
-                    // тогава актуализираме разстоянието
-                    if (nb_pxl.key_dists.find(new_key_comb) == nb_pxl.key_dists.end() ||
-                        nb_pxl.key_dists[new_key_comb] > (curr_dist_it->second + weight))
-                    {
-                        nb_pxl.key_dists[new_key_comb] = curr_dist_it->second + weight;
-                        wave.push(CoordComb(nb, new_key_comb));
-                    }
+        // на границата между нивата опашката съдържа точно вълната на level
+        if (reached > ws->pixel_count / BITS_SHARE) {
+            return bits_search(cost, level, limits, to_first_end);
+        }
+
+        for (size_t count = wave.size(); count > 0; count--) {
+            State curr = wave.front();
+            wave.pop();
+            size_t curr_dist = ws->get_dist(curr.layer, pixel_indx(curr.coord));
+
+            for (int i = -1; i < 2; i++) {
+                for (int j = -1; j < 2; j++) {
+                    if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+                    Coord nb = curr.coord + Coord(i, j);
+                    size_t new_layer;
+                    if (!step_to(nb, curr.layer, new_layer)) continue;
+
+                    size_t nb_indx = pixel_indx(nb);
+                    if (ws->get_dist(new_layer, nb_indx) != MAX_DIST) continue;
+
+                    ws->set_dist(new_layer, nb_indx, curr_dist + cost(color_at(nb)));
+                    wave.push(State(nb, new_layer));
+                    reached++;
                 }
-                catch (MazeException& e) {
-                    continue;
-                };
             }
         }
     }
+    return true;
 }
 
-void Maze::write_points(const std::vector<Coord>& path) {
-    std::ofstream out_file("output.txt", std::ios::trunc);
+// The BFS is level-synchronous and bit-parallel: the wavefront of every layer is a bitboard advanced with one
+// expand() per level, and the bits that land on a key the layer doesn't have are moved to the layer with that key.
+// Only the words of the wavefront are touched and layers the wave hasn't reached are skipped.
+template<class CostModel>
+bool Maze::bits_search(const CostModel& cost, size_t level, const SearchLimits& limits, bool to_first_end) {
+    if (!classify_all(limits) || !build_masks(limits)) return false;
+
+    // посетени са състоянията с разстояние, вълната е опашката
+    for (size_t l = 0; l < key_combs.size(); l++) {
+        if (limits.stop()) return false;
+
+        Workspace::Layer& layer = bits_layer(l);
+        for (size_t indx = 0; indx < layer.stamps.size(); indx++) {
+            if (!layer.stamps.test(indx, ws->epoch)) continue;
 
-    bool horizontal = false;
+            Coord curr = coord_at(indx);
+            layer.visited.set(curr.row, curr.col);
+        }
+    }
+
+    RingQueue<Workspace::State>& wave = ws->wave;
+    while (!wave.empty()) {
+        Workspace::State curr = wave.front();
+        wave.pop();
 
-    if (path.size() != 0) {
-        out_file << path[0].row << " " << path[0].col << "\n";
+        Workspace::Layer& layer = bits_layer(curr.layer);
+        uint32_t word = layer.frontier.word_at(curr.coord.row, curr.coord.col);
+        if (!layer.frontier.test(curr.coord.row, curr.coord.col)) {
+            layer.frontier_words.push_back(word);
+        }
+        layer.frontier.set(curr.coord.row, curr.coord.col);
     }
 
-    for (size_t i = 1; i < path.size(); i++) {
-        if (i == path.size() - 1)  out_file << path[i].row << " " << path[i].col << "\n";
+    // слоевете, до които още не е стигнала вълната, не се заделят
+    auto live = [&](size_t l) {
+        return l < ws->layers.size() && ws->layers[l].bits_epoch == ws->epoch;
+    };
+
+    bool active = true;
+    for (level++; active; level++) {
+        if (limits.stop()) return false;
+        if (to_first_end && !ends.empty()) return true;
+
+        size_t layers = key_combs.size();
 
-        if (horizontal && path[i].row != path[i - 1].row) {
-            if (i + 1 != path.size() && path[i + 1].row != path[i - 1].row) {
-                out_file << path[i].row << " " << path[i].col << "\n";
-                horizontal = !horizontal;
+        for (size_t l = 0; l < layers; l++) {
+            if (!live(l)) continue;
+            Workspace::Layer& layer = bits_layer(l);
+            layer.frontier.expand(layer.frontier_words, layer.passable, layer.visited, layer.next, layer.next_words);
+        }
+
+        // пикселите от ключове, които слоят няма, минават в слоя с добавения ключ
+        for (size_t l = 0; l < layers; l++) {
+            if (!live(l)) continue;
+            Workspace::Layer& layer = bits_layer(l);
+            if (!layer.next.intersects(layer.next_words, layer.new_keys)) continue;
+
+            for (size_t k = 0; k < keys.size(); k++) {
+                if (key_combs[l].has(k)) continue;
+
+                size_t nl = layer_with_key(l, k);
+                Workspace::Layer& to = bits_layer(nl);
+                Workspace::Layer& from = bits_layer(l);
+                from.next.move_to(from.next_words, ws->key_masks[k], to.visited, to.next, to.next_words);
             }
         }
-        if (!horizontal && path[i].col != path[i - 1].col) {
-            if (i + 1 != path.size() && path[i + 1].col != path[i - 1].col) {
-                out_file << path[i].row << " " << path[i].col << "\n";
-                horizontal = !horizontal;
+
+        active = false;
+        for (size_t l = 0; l < key_combs.size(); l++) {
+            if (!live(l)) continue;
+            Workspace::Layer& layer = bits_layer(l);
+
+            // по редове, за да се намират краищата в същия ред като при обхождане на цялата дъска
+            Bitboard::sort_words(layer.next_words);
+            layer.next.for_each(layer.next_words, [&](size_t row, size_t col) {
+                Coord curr(row, col);
+                ws->set_dist(l, pixel_indx(curr), level * cost(color_at(curr)));
+
+                if (type_at(curr) == PixelType::END && !ws->ends_seen.test(row, col)) {
+                    ends.push_back(curr);
+                    RowRange end_rows(row, row);
+                    ws->ends_seen.set(row, col);
+                    ws->ends_seen.flood(ws->same_right, ws->same_down, end_rows);
+                }
+            });
+
+            layer.visited.unite(layer.next, layer.next_words);
+            layer.frontier.clear_words(layer.frontier_words);
+            layer.frontier_words.clear();
+            std::swap(layer.frontier, layer.next);
+            layer.frontier_words.swap(layer.next_words);
+
+            if (!layer.frontier_words.empty()) active = true;
+        }
+    }
+    return true;
+}
+
+template void Maze::find_path<Maze::GreyCost>(const GreyCost& cost);
+template void Maze::find_path<Maze::UniformCost>(const UniformCost& cost);
+template void Maze::find_path<Maze::LutCost>(const LutCost& cost);
+
+// words: width, height, found, cost (low, high), best end, then ends, path and best path, each as size + coords
+template<class Visit>
+void Maze::pack_solution(const Solution& solution, std::vector<uint32_t>& words, Visit visit) {
+    words.clear();
+    words.push_back(uint32_t(width));
+    words.push_back(uint32_t(height));
+    words.push_back(solution.best.found ? 1 : 0);
+    words.push_back(uint32_t(solution.best.cost));
+    words.push_back(uint32_t(uint64_t(solution.best.cost) >> 32));
+    words.push_back(uint32_t(solution.best.end.row));
+    words.push_back(uint32_t(solution.best.end.col));
+
+    std::vector<Coord> path;
+    const std::vector<Coord>* lists[] = { &solution.ends, &solution.path, &solution.best.path };
+    for (size_t l = 0; l < 3; l++) {
+        size_t count_pos = words.size();
+        words.push_back(uint32_t(lists[l]->size()));
+        for (std::vector<Coord>::const_iterator it = lists[l]->begin(); it != lists[l]->end(); it++) {
+            words.push_back(uint32_t(it->row));
+            words.push_back(uint32_t(it->col));
+        }
+
+        // пътищата се проследяват един по един направо в думите
+        if (l == 1 && solution.from_search) {
+            for (std::vector<Coord>::const_iterator end = solution.ends.begin(); end != solution.ends.end(); end++) {
+                path.clear();
+                trace_path(*end, path);
+                for (std::vector<Coord>::const_iterator it = path.begin(); it != path.end(); it++) {
+                    words.push_back(uint32_t(it->row));
+                    words.push_back(uint32_t(it->col));
+                    visit(*it);
+                }
             }
+            words[count_pos] = uint32_t((words.size() - count_pos - 1) / 2);
         }
     }
 }
 
-void Maze::save_path(Bitmap_Image& bmp_img) {
-    using KeyCombIter = std::unordered_set<KeyCombination, KeyCombination::Hasher>::iterator;
-    using PixelDists = std::unordered_map<KeyCombIter, size_t, Pixel::umap_iterator_hasher>::iterator;
+bool Maze::unpack_solution(const std::vector<uint32_t>& words, Solution& solution) const {
+    if (words.size() < 7 || words[0] != width || words[1] != height) return false;
+
+    solution.from_search = false;
+    solution.best.found = words[2] != 0;
+    solution.best.cost = size_t(words[3] | (uint64_t(words[4]) << 32));
+    solution.best.end = Coord(words[5], words[6]);
+
+    std::vector<Coord>* lists[] = { &solution.ends, &solution.path, &solution.best.path };
+    size_t pos = 7;
+    for (size_t l = 0; l < 3; l++) {
+        if (pos >= words.size()) return false;
+        size_t count = words[pos++];
+        if ((words.size() - pos) / 2 < count) return false;
+
+        lists[l]->clear();
+        lists[l]->reserve(count);
+        for (size_t i = 0; i < count; i++, pos += 2) {
+            Coord c(words[pos], words[pos + 1]);
+            if (!is_valid(c)) return false;
+            lists[l]->push_back(c);
+        }
+    }
+    return pos == words.size();
+}
 
-    if (ends.empty()) {
-        std::ofstream out_file("output.txt", std::ios::trunc);
-        out_file << "no solution";
-        out_file.close();
-        std::cout << "There is no path.\n";
-        return;
+template<class CostModel>
+bool Maze::find_path_cached(ResultCache& cache, const CostModel& cost, Solution& solution) {
+    begin_solve();
+    uint64_t key = hash_mix(hash_mix(pixels_hash, cost.hash()), 'P');
+
+    std::vector<uint32_t> words;
+    if (cache.load(key, words) && unpack_solution(words, solution)) {
+        // ENDs от по-старо търсене не бива да изглеждат като резултата от кеша
+        ends.clear();
+        return true;
     }
 
-    std::vector<Coord> path;
+    find_path(cost, std::integral_constant<bool, CostModel::IS_UNIFORM>());
+    solution = Solution();
+    solution.ends = ends;
+    solution.best = get_path();
+    solution.from_search = true;
+    solution.cache = &cache;
+    solution.cache_key = key;
+    return false;
+}
 
-    // save only the shortest path (not all paths)
-    // Coord curr = ends[0];
+template bool Maze::find_path_cached<Maze::GreyCost>(ResultCache& cache, const GreyCost& cost, Solution& solution);
+template bool Maze::find_path_cached<Maze::UniformCost>(ResultCache& cache, const UniformCost& cost, Solution& solution);
+template bool Maze::find_path_cached<Maze::LutCost>(ResultCache& cache, const LutCost& cost, Solution& solution);
 
-    // save paths to every end
-    for (std::vector<Coord>::iterator end = ends.begin(); end != ends.end(); end++) {
-        Coord curr = *end;
-        bmp_set_color_at(bmp_img, curr, PATH_COLOR);
-        KeyCombIter key_comb;
-        while (true) {
-            Pixel& p = pixel_at(curr);
+size_t Maze::mask_layer(uint64_t mask) {
+    KeyCombination key_comb = START_KEY_COMB;
+    for (size_t k = 0; k < keys.size(); k++) {
+        if ((mask >> k) & 1) key_comb = key_comb.set_at(k);
+    }
+    return comb_layer(key_comb);
+}
 
-            if (p.type == Pixel::Type::START && *key_comb == START_KEY_COMB) break;
+template<class CostModel>
+void Maze::layer_search(uint64_t mask, size_t layer, const CostModel& cost,
+    std::unordered_map<uint64_t, std::unique_ptr<HandoffStack<std::pair<size_t, size_t>>>>& handoffs,
+    std::vector<Coord>& reached_ends)
+{
+    using DistIndx = std::pair<size_t, size_t>;
+
+    // предадените състояния са (пиксел, цена), а в купчината - (цена, пиксел)
+    std::vector<DistIndx> heap;
+    handoffs.at(mask)->take(heap);
+    for (std::vector<DistIndx>::iterator it = heap.begin(); it != heap.end(); it++) {
+        std::swap(it->first, it->second);
+    }
 
-            if (p.type == Pixel::Type::END) {
-                size_t min_dist = MAX_DIST;
-                for (PixelDists it = p.key_dists.begin(); it != p.key_dists.end(); it++) {
-                    if (it->second < min_dist) {
-                        key_comb = it->first;
-                        min_dist = it->second;
-                    }
-                }
-            }
+    std::greater<DistIndx> cmp;
+    std::vector<DistIndx> seeds;
+    seeds.swap(heap);
+    for (std::vector<DistIndx>::iterator it = seeds.begin(); it != seeds.end(); it++) {
+        if (it->first < ws->get_dist(layer, it->second)) {
+            ws->set_dist(layer, it->second, it->first);
+            heap.push_back(*it);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), cmp);
 
-            // намираме съседа с минимална дистанция от тази комбинация
-            // ако сме в ключ с комбинация, която той няма, значи сме излезли от него и сме с 1 комбинация назад
-            // тогава цената на следващия пиксел с новата комбинация не зависи от тази на ключа(приемаме я за MAX_DIST)
-            Coord next = curr;
-            size_t min_dist = MAX_DIST;
-            if (p.type == Pixel::Type::KEY && p.key_dists.find(key_comb) != p.key_dists.end()) {
-                min_dist = p.key_dists[key_comb];
-            }
-            // UL U UR  L R  DL D DR
-            for (int i = -1; i < 2; i++) {
-                for (int j = -1; j < 2; j++) {
-                    if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+    std::unordered_map<uint64_t, std::vector<DistIndx>> out; // key set -> (pixel, cost)
+    const PoolVector<size_t>& pixel_keys = ws->pixel_keys;
 
-                    try {
-                        // взимаме съседния пиксел на текущия пиксел
-                        Coord nb = curr + Coord(i, j);
-                        Pixel& nb_pxl = pixel_at(nb);
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), cmp);
+        DistIndx curr = heap.back();
+        heap.pop_back();
+        if (curr.first > ws->get_dist(layer, curr.second)) continue;
 
-                        // ако съседния пиксел има цена с текущата комбинация го обработваме
-                        PixelDists it = nb_pxl.key_dists.find(key_comb);
-                        if (it == nb_pxl.key_dists.end()) continue;
+        Coord c = coord_at(curr.second);
+        if (type_at(c) == PixelType::END) reached_ends.push_back(c);
 
-                        if (it->second < min_dist) {
-                            next = nb;
-                            min_dist = it->second;
-                        }
-                    }
-                    catch (MazeException& e) { continue; }
-                }
-            }
+        for (int i = -1; i < 2; i++) {
+            for (int j = -1; j < 2; j++) {
+                if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
 
-            // Ако няма съсед с по-малка дистанция:
-            //  - ако сме в ключ тогава махаме цвета на ключа от комбинацията и проверяваме тогава съседите
-            //  - ако сме в поле различно от ключ значи пряк няма път
-            if (next == curr) {
-                if (p.type == Pixel::Type::KEY) {
-                    KeyCombination kb = key_comb->unset_at(keys[p.color]);
-                    key_comb = key_combs.find(kb);
-                }
-                else {
-                    throw MazeException("ERROR: There is no path, but ends[] is not empty.");
-                }
-            }
+                Coord nb = c + Coord(i, j);
+                if (!is_valid(nb)) continue;
+
+                PixelType nb_type = type_at(nb);
+                if (nb_type == PixelType::WALL) continue;
+
+                size_t nb_indx = pixel_indx(nb);
+                size_t g = curr.first + cost(color_at(nb));
+                if (nb_type == PixelType::ZONE &&
+                    (pixel_keys[nb_indx] == NO_LAYER || !((mask >> pixel_keys[nb_indx]) & 1))) continue;
+
+                if (nb_type == PixelType::KEY && !((mask >> pixel_keys[nb_indx]) & 1)) {
+                    out[mask | (uint64_t(1) << pixel_keys[nb_indx])].push_back(DistIndx(nb_indx, g));
+                    continue;
+                }
+
+                if (g < ws->get_dist(layer, nb_indx)) {
+                    ws->set_dist(layer, nb_indx, g);
+                    heap.push_back(DistIndx(g, nb_indx));
+                    std::push_heap(heap.begin(), heap.end(), cmp);
+                }
+            }
+        }
+    }
+
+    for (std::unordered_map<uint64_t, std::vector<DistIndx>>::iterator it = out.begin(); it != out.end(); it++) {
+        handoffs.at(it->first)->push(std::move(it->second));
+    }
+}
+
+void Maze::find_path_parallel(WorkPool& pool) {
+    find_path_parallel(GreyCost(), pool);
+}
+
+template<class CostModel>
+void Maze::find_path_parallel(const CostModel& cost, WorkPool& pool) {
+    begin_solve();
+    using DistIndx = std::pair<size_t, size_t>;
+    using Handoffs = std::unordered_map<uint64_t, std::unique_ptr<HandoffStack<DistIndx>>>;
+
+    Coord start = get_start();
+    classify_all();
+    if (keys.size() > MAX_PARALLEL_KEYS) {
+        find_path(cost);
+        return;
+    }
+    begin_search();
+
+    // задачите само четат типовете и номерата на ключовете, затова ги попълваме предварително
+    PoolVector<size_t>& pixel_keys = ws->pixel_keys;
+    pixel_keys.assign(ws->pixel_count, NO_LAYER);
+    for (size_t i = 0; i < height; i++) {
+        for (size_t j = 0; j < width; j++) {
+            Coord curr(i, j);
+            PixelType type = type_at(curr);
+            if (type != PixelType::KEY && type != PixelType::ZONE) continue;
+
+            std::unordered_map<Color, size_t, Color::Hasher>::iterator key = keys.find(color_at(curr));
+            if (key != keys.end()) pixel_keys[pixel_indx(curr)] = key->second;
+        }
+    }
+
+    Handoffs handoffs;
+    handoffs[0].reset(new HandoffStack<DistIndx>());
+    handoffs[0]->push(std::vector<DistIndx>(1, DistIndx(pixel_indx(start), 0)));
+
+    std::vector<uint64_t> wave(1, 0);
+    while (!wave.empty()) {
+        // слоевете и стековете на следващата вълна се правят преди задачите, за да не се менят по време на тях
+        std::vector<size_t> wave_layers;
+        for (size_t w = 0; w < wave.size(); w++) {
+            wave_layers.push_back(mask_layer(wave[w]));
+            ws->layer_at(wave_layers.back());
+
+            for (size_t k = 0; k < keys.size(); k++) {
+                uint64_t next = wave[w] | (uint64_t(1) << k);
+                if (next != wave[w] && handoffs.find(next) == handoffs.end()) {
+                    handoffs[next].reset(new HandoffStack<DistIndx>());
+                }
+            }
+        }
+
+        std::vector<std::vector<Coord>> reached_ends(wave.size());
+        std::vector<std::function<void()>> tasks;
+        for (size_t w = 0; w < wave.size(); w++) {
+            tasks.push_back([&, w]() {
+                layer_search(wave[w], wave_layers[w], cost, handoffs, reached_ends[w]);
+            });
+        }
+        pool.run(tasks);
+
+        for (size_t w = 0; w < wave.size(); w++) {
+            for (std::vector<Coord>::iterator it = reached_ends[w].begin(); it != reached_ends[w].end(); it++) {
+                if (ws->ends_seen.test(it->row, it->col)) continue;
+
+                ends.push_back(*it);
+                RowRange end_rows(it->row, it->row);
+                ws->ends_seen.set(it->row, it->col);
+                ws->ends_seen.flood(ws->same_right, ws->same_down, end_rows);
+            }
+            handoffs.erase(wave[w]);
+        }
+
+        // следващата вълна са множествата с един ключ повече, до които е стигнато
+        std::vector<uint64_t> next_wave;
+        for (Handoffs::iterator it = handoffs.begin(); it != handoffs.end();) {
+            if (it->second->empty()) {
+                it = handoffs.erase(it);
+            }
+            else {
+                next_wave.push_back(it->first);
+                it++;
+            }
+        }
+        std::sort(next_wave.begin(), next_wave.end());
+        wave.swap(next_wave);
+    }
+}
+
+template void Maze::find_path_parallel<Maze::GreyCost>(const GreyCost& cost, WorkPool& pool);
+template void Maze::find_path_parallel<Maze::UniformCost>(const UniformCost& cost, WorkPool& pool);
+template void Maze::find_path_parallel<Maze::LutCost>(const LutCost& cost, WorkPool& pool);
+
+Maze::BatchScope::BatchScope(Maze& maze) : maze(maze), contracted_dists(maze.contracted_dists) {
+    ends.swap(maze.ends);
+    maze.ws->swap_batch_state();
+}
+
+Maze::BatchScope::~BatchScope() {
+    maze.ws->swap_batch_state();
+    maze.ends.swap(ends);
+    maze.contracted_dists = contracted_dists;
+}
+
+template<class CostModel>
+void Maze::batch_search(const Coord& source, const CostModel& cost, size_t targets_left) {
+    using State = Workspace::State;
+    using OpenState = Workspace::OpenState;
+
+    if (type_at(source) == PixelType::UNSET) set_area_at(source);
+    begin_search();
+    if (type_at(source) == PixelType::WALL) {
+        ws->batch_targets.clear();
+        return;
+    }
+
+    size_t start_layer = comb_layer(START_KEY_COMB);
+    ws->set_dist(start_layer, pixel_indx(source), 0);
+    ws->set_parent(start_layer, pixel_indx(source), NO_PARENT);
+
+    PoolVector<OpenState>& open = ws->open;
+    std::greater<OpenState> cmp;
+    open.clear();
+    open.push_back(OpenState(0, 0, State(source, start_layer)));
+
+    while (!open.empty() && targets_left > 0) {
+        std::pop_heap(open.begin(), open.end(), cmp);
+        OpenState curr = open.back();
+        open.pop_back();
+
+        size_t curr_indx = pixel_indx(curr.state.coord);
+        if (curr.g > ws->get_dist(curr.state.layer, curr_indx)) continue;
+
+        // първото вадене на целта е най-евтиното при всички комбинации от ключове
+        if (ws->batch_targets.test(curr.state.coord.row, curr.state.coord.col)) {
+            ws->batch_targets.reset(curr.state.coord.row, curr.state.coord.col);
+            targets_left--;
+        }
+
+        for (int i = -1; i < 2; i++) {
+            for (int j = -1; j < 2; j++) {
+                if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+                Coord nb = curr.state.coord + Coord(i, j);
+                size_t new_layer;
+                if (!step_to(nb, curr.state.layer, new_layer)) continue;
+
+                size_t g = curr.g + cost(color_at(nb));
+                size_t nb_indx = pixel_indx(nb);
+                if (ws->get_dist(new_layer, nb_indx) > g) {
+                    ws->set_dist(new_layer, nb_indx, g);
+                    ws->set_parent(new_layer, nb_indx, (uint64_t(curr.state.layer) << 32) | curr_indx);
+                    open.push_back(OpenState(double(g), g, State(nb, new_layer)));
+                    std::push_heap(open.begin(), open.end(), cmp);
+                }
+            }
+        }
+    }
+
+    // неизвадените цели са недостижими, махаме ги за следващото търсене
+    if (targets_left > 0) ws->batch_targets.clear();
+}
+
+template<class CostModel>
+void Maze::batch_search_back(const Coord& target, const CostModel& cost, size_t sources_left) {
+    using State = Workspace::State;
+    using OpenState = Workspace::OpenState;
+
+    begin_search();
+    size_t layer = comb_layer(START_KEY_COMB);
+    ws->set_dist(layer, pixel_indx(target), 0);
+
+    PoolVector<OpenState>& open = ws->open;
+    std::greater<OpenState> cmp;
+    open.clear();
+    open.push_back(OpenState(0, 0, State(target, layer)));
+
+    while (!open.empty() && sources_left > 0) {
+        std::pop_heap(open.begin(), open.end(), cmp);
+        OpenState curr = open.back();
+        open.pop_back();
+
+        if (curr.g > ws->get_dist(layer, pixel_indx(curr.state.coord))) continue;
+
+        if (ws->batch_targets.test(curr.state.coord.row, curr.state.coord.col)) {
+            ws->batch_targets.reset(curr.state.coord.row, curr.state.coord.col);
+            sources_left--;
+        }
+
+        // съседът е стъпка преди curr, затова плаща влизането в curr; в зона без ключове не се влиза,
+        // но тя все пак може да е началото на пътя
+        if (type_at(curr.state.coord) == PixelType::ZONE) continue;
+        size_t g = curr.g + cost(color_at(curr.state.coord));
+
+        for (int i = -1; i < 2; i++) {
+            for (int j = -1; j < 2; j++) {
+                if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+                Coord nb = curr.state.coord + Coord(i, j);
+                if (!is_valid(nb) || type_at(nb) == PixelType::WALL) continue;
+
+                size_t nb_indx = pixel_indx(nb);
+                if (ws->get_dist(layer, nb_indx) > g) {
+                    ws->set_dist(layer, nb_indx, g);
+                    open.push_back(OpenState(double(g), g, State(nb, layer)));
+                    std::push_heap(open.begin(), open.end(), cmp);
+                }
+            }
+        }
+    }
+
+    if (sources_left > 0) ws->batch_targets.clear();
+}
+
+size_t Maze::min_dist_at(const Coord& c, size_t& layer) const {
+    size_t min_dist = MAX_DIST;
+    layer = NO_LAYER;
+    for (size_t l = 0; l < key_combs.size(); l++) {
+        size_t dist = ws->get_dist(l, pixel_indx(c));
+        if (dist < min_dist) {
+            min_dist = dist;
+            layer = l;
+        }
+    }
+    return min_dist;
+}
+
+Maze::BatchResult Maze::find_batch(const std::vector<Coord>& sources, const std::vector<Coord>& targets) {
+    return find_batch(sources, targets, GreyCost());
+}
+
+template<class CostModel>
+Maze::BatchResult Maze::find_batch(const std::vector<Coord>& sources, const std::vector<Coord>& targets,
+    const CostModel& cost)
+{
+    begin_solve();
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    BatchResult batch;
+    batch.sources = sources;
+    batch.targets = targets;
+    batch.costs.assign(sources.size() * targets.size(), BatchResult::NO_PATH);
+
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (!is_valid(sources[i])) throw MazeException("ERROR: Batch source is outside the maze.");
+    }
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (!is_valid(targets[i])) throw MazeException("ERROR: Batch target is outside the maze.");
+    }
+
+    // без ключове цената от source до target е същата, сметната назад от target, така че с по-малко цели
+    // търсим от тях; с ключове обратното търсене не знае с кои ключове пристига в целта
+    std::unordered_set<size_t> distinct_sources, distinct_targets;
+    for (size_t i = 0; i < sources.size(); i++) distinct_sources.insert(pixel_indx(sources[i]));
+    for (size_t i = 0; i < targets.size(); i++) distinct_targets.insert(pixel_indx(targets[i]));
+    bool backward = distinct_targets.size() < distinct_sources.size() && classify_all(SearchLimits()) && keys.empty();
+
+    const std::vector<Coord>& from = backward ? targets : sources;
+    const std::vector<Coord>& to = backward ? sources : targets;
+    auto entry = [&](size_t f, size_t t) -> size_t& {
+        return backward ? batch.costs[t * targets.size() + f] : batch.costs[f * targets.size() + t];
+    };
+
+    BatchScope scope(*this);
+    ws->batch_targets.resize(width, height);
+    std::unordered_map<size_t, size_t> searched; // pixel indx of a search start -> its first index in from
+
+    for (size_t f = 0; f < from.size(); f++) {
+        std::unordered_map<size_t, size_t>::iterator same = searched.find(pixel_indx(from[f]));
+        if (same != searched.end()) {
+            for (size_t t = 0; t < to.size(); t++) {
+                entry(f, t) = entry(same->second, t);
+            }
+            continue;
+        }
+        searched[pixel_indx(from[f])] = f;
+
+        // стените не се достигат и не бива да държат търсенето до края
+        size_t left = 0;
+        for (size_t t = 0; t < to.size(); t++) {
+            if (type_at(to[t]) == PixelType::UNSET) set_area_at(to[t]);
+            if (type_at(to[t]) == PixelType::WALL) continue;
+
+            if (!ws->batch_targets.test(to[t].row, to[t].col)) {
+                ws->batch_targets.set(to[t].row, to[t].col);
+                left++;
+            }
+        }
+
+        if (!backward) {
+            batch_search(from[f], cost, left);
+        }
+        else if (type_at(from[f]) != PixelType::WALL) {
+            batch_search_back(from[f], cost, left);
+        }
+        else {
+            ws->batch_targets.clear();
+            continue;
+        }
+        batch.searches++;
+
+        size_t layer;
+        for (size_t t = 0; t < to.size(); t++) {
+            size_t dist = min_dist_at(to[t], layer);
+            if (dist != MAX_DIST) entry(f, t) = dist;
+        }
+    }
+
+    batch.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return batch;
+}
+
+template Maze::BatchResult Maze::find_batch<Maze::GreyCost>(const std::vector<Coord>& sources,
+    const std::vector<Coord>& targets, const GreyCost& cost);
+template Maze::BatchResult Maze::find_batch<Maze::UniformCost>(const std::vector<Coord>& sources,
+    const std::vector<Coord>& targets, const UniformCost& cost);
+template Maze::BatchResult Maze::find_batch<Maze::LutCost>(const std::vector<Coord>& sources,
+    const std::vector<Coord>& targets, const LutCost& cost);
+
+Maze::PathResult Maze::batch_path(const BatchResult& batch, size_t source, size_t target) {
+    return batch_path(batch, source, target, GreyCost());
+}
+
+template<class CostModel>
+Maze::PathResult Maze::batch_path(const BatchResult& batch, size_t source, size_t target, const CostModel& cost) {
+    begin_solve();
+    PathResult res;
+    if (source >= batch.sources.size() || target >= batch.targets.size()) {
+        throw MazeException("ERROR: There is no such batch query.");
+    }
+    if (batch.cost(source, target) == BatchResult::NO_PATH) return res;
+
+    const Coord& end = batch.targets[target];
+    BatchScope scope(*this);
+    ws->batch_targets.resize(width, height);
+    ws->batch_targets.set(end.row, end.col);
+    batch_search(batch.sources[source], cost, 1);
+
+    size_t layer;
+    res.cost = min_dist_at(end, layer);
+    if (res.cost == MAX_DIST) return res;
+    res.found = true;
+    res.end = end;
+
+    uint64_t parent = ws->get_parent(layer, pixel_indx(end));
+    while (parent != NO_PARENT) {
+        size_t indx = parent & 0xFFFFFFFF;
+        layer = parent >> 32;
+        res.path.push_back(coord_at(indx));
+        parent = ws->get_parent(layer, indx);
+    }
+    return res;
+}
+
+template Maze::PathResult Maze::batch_path<Maze::GreyCost>(const BatchResult& batch, size_t source, size_t target,
+    const GreyCost& cost);
+template Maze::PathResult Maze::batch_path<Maze::UniformCost>(const BatchResult& batch, size_t source, size_t target,
+    const UniformCost& cost);
+template Maze::PathResult Maze::batch_path<Maze::LutCost>(const BatchResult& batch, size_t source, size_t target,
+    const LutCost& cost);
+
+void Maze::build_rects() {
+    ws->rects.clear();
+    ws->rect_of.assign(ws->pixel_count, NO_RECT);
+
+    // Алчно, по реда на пикселите: от всеки още свободен пиксел взимаме правоъгълника с най-голямо лице с горен ляв
+    // ъгъл в него. Слизаме ред по ред, ширината е най-късата серия от еднакви свободни пиксели досега.
+    for (size_t i = 0; i < height; i++) {
+        for (size_t j = 0; j < width; j++) {
+            size_t indx = pixel_indx(Coord(i, j));
+            if (ws->rect_of[indx] != NO_RECT || types[indx] == PixelType::WALL) continue;
+
+            size_t right = width - 1;
+            size_t best_area = 0, best_bottom = i, best_right = j;
+            for (size_t r = i; r < height; r++) {
+                size_t first = pixel_indx(Coord(r, j));
+                if (r > i && (!ws->same_down.test(r - 1, j) || ws->rect_of[first] != NO_RECT || types[first] != types[indx])) break;
+
+                size_t c = j;
+                while (c < right && ws->same_right.test(r, c)) {
+                    size_t next = pixel_indx(Coord(r, c + 1));
+                    if (ws->rect_of[next] != NO_RECT || types[next] != types[indx]) break;
+                    c++;
+                }
+                right = c;
+
+                size_t area = (r - i + 1) * (right - j + 1);
+                if (area > best_area) {
+                    best_area = area;
+                    best_bottom = r;
+                    best_right = right;
+                }
+            }
+            size_t bottom = best_bottom;
+            size_t right_col = best_right;
+
+            uint32_t rect = (uint32_t)ws->rects.size();
+            ws->rects.push_back(Workspace::Rect((uint32_t)i, (uint32_t)j, (uint32_t)bottom, (uint32_t)right_col));
+            for (size_t r = i; r <= bottom; r++) {
+                for (size_t c = j; c <= right_col; c++) {
+                    ws->rect_of[pixel_indx(Coord(r, c))] = rect;
+                }
+            }
+        }
+    }
+}
+
+void Maze::mark_stops(const Coord& c, const Workspace::Rect& rect) {
+    bool stop = (c.row == rect.top || c.row == rect.bottom) && (c.col == rect.left || c.col == rect.right);
+
+    for (int i = -1; i < 2 && !stop; i++) {
+        for (int j = -1; j < 2 && !stop; j++) {
+            if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+            Coord nb = c + Coord(i, j);
+            if (is_valid(nb) && !rect.contains(nb) && type_at(nb) != PixelType::WALL) stop = true;
+        }
+    }
+
+    if (stop) {
+        ws->stops.set(c.row, c.col);
+        ws->stops_t.set(c.col, c.row);
+    }
+}
+
+void Maze::contract() {
+    begin_solve();
+    if (contracted) return;
+
+    classify_all();
+    build_rects();
+
+    ws->stops.resize(width, height);
+    ws->stops_t.resize(height, width);
+    for (PoolVector<Workspace::Rect>::iterator rect = ws->rects.begin(); rect != ws->rects.end(); rect++) {
+        for (size_t r = rect->top; r <= rect->bottom; r++) {
+            bool edge_row = r == rect->top || r == rect->bottom;
+            for (size_t c = rect->left; c <= rect->right; c = edge_row || c == rect->right ? c + 1 : rect->right) {
+                mark_stops(Coord(r, c), *rect);
+            }
+        }
+    }
+
+    Coord start = get_start();
+    ws->stops.set(start.row, start.col);
+    ws->stops_t.set(start.col, start.row);
+
+    // завоите на коридорите - търсенето минава през тях без да ги слага в опашката
+    ws->corridors.resize(width, height);
+    ws->stops.for_each(RowRange(0, height - 1), [&](size_t row, size_t col) {
+        Coord c(row, col);
+        Coord nbs[2];
+        size_t steps[2];
+        if (c != start && type_at(c) == PixelType::FREE && corridor_neighbours(c, nbs, steps) == 2) {
+            ws->corridors.set(row, col);
+        }
+    });
+
+    contracted = true;
+}
+
+size_t Maze::contracted_nodes() const {
+    check_workspace();
+    if (!contracted) return 0;
+
+    size_t count = 0;
+    ws->stops.for_each(RowRange(0, height - 1), [&](size_t row, size_t col) {
+        if (!ws->corridors.test(row, col)) count++;
+    });
+    return count;
+}
+
+template<class F>
+void Maze::for_each_contracted(const Coord& c, F f) const {
+    const Workspace::Rect& rect = ws->rects[ws->rect_of[pixel_indx(c)]];
+    bool edge_row = c.row == rect.top || c.row == rect.bottom;
+    bool edge_col = c.col == rect.left || c.col == rect.right;
+
+    // съседите от другите правоъгълници
+    for (int i = -1; i < 2; i++) {
+        for (int j = -1; j < 2; j++) {
+            if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+            Coord nb = c + Coord(i, j);
+            if (is_valid(nb) && !rect.contains(nb)) f(nb, 1);
+        }
+    }
+
+    // по ръба до следващия стоп в двете посоки
+    if (edge_row) {
+        if (c.col > rect.left) {
+            size_t col = ws->stops.prev_in_row(c.row, c.col, rect.left);
+            f(Coord(c.row, col), c.col - col);
+        }
+        if (c.col < rect.right) {
+            size_t col = ws->stops.next_in_row(c.row, c.col, rect.right);
+            f(Coord(c.row, col), col - c.col);
+        }
+    }
+    if (edge_col) {
+        if (c.row > rect.top) {
+            size_t row = ws->stops_t.prev_in_row(c.col, c.row, rect.top);
+            f(Coord(row, c.col), c.row - row);
+        }
+        if (c.row < rect.bottom) {
+            size_t row = ws->stops_t.next_in_row(c.col, c.row, rect.bottom);
+            f(Coord(row, c.col), row - c.row);
+        }
+    }
+
+    // право през правоъгълника до срещуположния ръб
+    if (rect.top != rect.bottom) {
+        if (c.row == rect.top) f(Coord(rect.bottom, c.col), rect.bottom - rect.top);
+        if (c.row == rect.bottom) f(Coord(rect.top, c.col), rect.bottom - rect.top);
+    }
+    if (rect.left != rect.right) {
+        if (c.col == rect.left) f(Coord(c.row, rect.right), rect.right - rect.left);
+        if (c.col == rect.right) f(Coord(c.row, rect.left), rect.right - rect.left);
+    }
+
+    // началото може да е вътре в правоъгълника - от него се стига до четирите ръба
+    if (!edge_row && !edge_col) {
+        f(Coord(rect.top, c.col), c.row - rect.top);
+        f(Coord(rect.bottom, c.col), rect.bottom - c.row);
+        f(Coord(c.row, rect.left), c.col - rect.left);
+        f(Coord(c.row, rect.right), rect.right - c.col);
+    }
+}
+
+size_t Maze::corridor_neighbours(const Coord& c, Coord nbs[2], size_t steps[2]) const {
+    size_t count = 0;
+    for_each_contracted(c, [&](const Coord& nb, size_t s) {
+        if (type_at(nb) == PixelType::WALL) return;
+        for (size_t i = 0; i < count && i < 2; i++) {
+            if (nbs[i] == nb) return;
+        }
+        if (count < 2) {
+            nbs[count] = nb;
+            steps[count] = s;
+        }
+        if (count < 3) count++;
+    });
+    return count;
+}
+
+void Maze::find_path_contracted() {
+    find_path_contracted(GreyCost());
+}
+
+// Dijkstra over the stops. An edge inside a rectangle is a straight line, so its cost is the number of steps
+// times the cost of the rectangle's color.
+template<class CostModel>
+void Maze::find_path_contracted(const CostModel& cost) {
+    using State = Workspace::State;
+    using OpenState = Workspace::OpenState;
+
+    begin_solve();
+    contract();
+
+    Coord start = get_start();
+    begin_search();
+    contracted_dists = true;
+    size_t start_layer = comb_layer(START_KEY_COMB);
+    ws->set_dist(start_layer, pixel_indx(start), 0);
+    ws->set_parent(start_layer, pixel_indx(start), NO_PARENT);
+
+    PoolVector<OpenState>& open = ws->open;
+    std::greater<OpenState> cmp;
+    open.clear();
+    open.push_back(OpenState(0, 0, State(start, start_layer)));
+
+    while (!open.empty()) {
+        std::pop_heap(open.begin(), open.end(), cmp);
+        OpenState curr = open.back();
+        open.pop_back();
+
+        size_t curr_indx = pixel_indx(curr.state.coord);
+        if (curr.g > ws->get_dist(curr.state.layer, curr_indx)) continue;
+
+        uint64_t parent = ((uint64_t)curr.state.layer << 32) | curr_indx;
+        for_each_contracted(curr.state.coord, [&](const Coord& nb, size_t steps) {
+            size_t new_layer;
+            if (!step_to(nb, curr.state.layer, new_layer)) return;
+
+            size_t g = curr.g + steps * cost(color_at(nb));
+            size_t nb_indx = pixel_indx(nb);
+            if (ws->get_dist(new_layer, nb_indx) <= g) return;
+            ws->set_dist(new_layer, nb_indx, g);
+            ws->set_parent(new_layer, nb_indx, parent);
+
+            // По коридора продължаваме до следващия възел с повече съседи. Пиксел от коридора получава по-малка
+            // дистанция само от другия му край, а тогава и оттам се върви по коридора, затова спираме там.
+            Coord prev = curr.state.coord;
+            Coord at = nb;
+            while (ws->corridors.test(at.row, at.col)) {
+                Coord nbs[2];
+                size_t nb_steps[2];
+                corridor_neighbours(at, nbs, nb_steps);
+                size_t other = nbs[0] == prev ? 1 : 0;
+                if (nbs[1 - other] != prev) break;
+
+                Coord next = nbs[other];
+                size_t next_layer;
+                if (!step_to(next, new_layer, next_layer)) return;
+
+                size_t next_g = g + nb_steps[other] * cost(color_at(next));
+                size_t next_indx = pixel_indx(next);
+                if (ws->get_dist(next_layer, next_indx) <= next_g) return;
+                ws->set_dist(next_layer, next_indx, next_g);
+                ws->set_parent(next_layer, next_indx, ((uint64_t)new_layer << 32) | pixel_indx(at));
+
+                prev = at;
+                at = next;
+                new_layer = next_layer;
+                g = next_g;
+            }
+
+            open.push_back(OpenState((double)g, g, State(at, new_layer)));
+            std::push_heap(open.begin(), open.end(), cmp);
+        });
+    }
+}
+
+template void Maze::find_path_contracted<Maze::GreyCost>(const GreyCost& cost);
+template void Maze::find_path_contracted<Maze::UniformCost>(const UniformCost& cost);
+template void Maze::find_path_contracted<Maze::LutCost>(const LutCost& cost);
+
+bool Maze::has_key(const Coord& c, uint64_t mask) const {
+    std::unordered_map<Color, size_t, Color::Hasher>::const_iterator key = keys.find(color_at(c));
+    return key != keys.end() && ((mask >> key->second) & 1);
+}
+
+size_t Maze::hierarchy_node(const Coord& c) {
+    size_t indx = pixel_indx(c);
+    std::unordered_map<size_t, size_t>::iterator it = hierarchy.node_of.find(indx);
+    if (it != hierarchy.node_of.end()) return it->second;
+
+    Hierarchy::Node node;
+    node.coord = c;
+    node.cluster = (c.row / hierarchy.cluster_size) * hierarchy.cluster_cols + c.col / hierarchy.cluster_size;
+    node.local = hierarchy.clusters[node.cluster].nodes.size();
+    node.key = NO_LAYER;
+    if (type_at(c) == PixelType::KEY) node.key = keys.find(color_at(c))->second;
+
+    size_t id = hierarchy.nodes.size();
+    hierarchy.nodes.push_back(node);
+    hierarchy.clusters[node.cluster].nodes.push_back(id);
+    hierarchy.node_of[indx] = id;
+    return id;
+}
+
+void Maze::link_nodes(const Coord& a, const Coord& b, size_t cost_ab, size_t cost_ba) {
+    size_t na = hierarchy_node(a);
+    size_t nb = hierarchy_node(b);
+    hierarchy.nodes[na].links.push_back(std::pair<size_t, size_t>(nb, cost_ab));
+    hierarchy.nodes[nb].links.push_back(std::pair<size_t, size_t>(na, cost_ba));
+}
+
+template<class CostModel>
+void Maze::build_hierarchy(const CostModel& cost, size_t cluster_size) {
+    begin_solve();
+    if (cluster_size == 0) throw MazeException("ERROR: Cluster size must be positive.");
+    if (hierarchy.built && hierarchy.cluster_size == cluster_size && hierarchy.cost_hash == cost.hash()) return;
+
+    classify_all();
+    if (keys.size() > MAX_PARALLEL_KEYS) {
+        throw MazeException("ERROR: Too many keys for the hierarchical search.");
+    }
+
+    hierarchy = Hierarchy();
+    hierarchy.cluster_size = cluster_size;
+    hierarchy.cost_hash = cost.hash();
+    hierarchy.cluster_cols = (width + cluster_size - 1) / cluster_size;
+    size_t cluster_rows = (height + cluster_size - 1) / cluster_size;
+
+    for (size_t cr = 0; cr < cluster_rows; cr++) {
+        for (size_t cc = 0; cc < hierarchy.cluster_cols; cc++) {
+            Hierarchy::Cluster cluster;
+            cluster.top = cr * cluster_size;
+            cluster.left = cc * cluster_size;
+            cluster.bottom = std::min(cluster.top + cluster_size, height) - 1;
+            cluster.right = std::min(cluster.left + cluster_size, width) - 1;
+            cluster.keys = 0;
+
+            for (size_t i = cluster.top; i <= cluster.bottom; i++) {
+                for (size_t j = cluster.left; j <= cluster.right; j++) {
+                    Coord curr(i, j);
+                    PixelType type = type_at(curr);
+                    if (type != PixelType::KEY && type != PixelType::ZONE) continue;
+
+                    std::unordered_map<Color, size_t, Color::Hasher>::iterator key = keys.find(color_at(curr));
+                    if (key != keys.end()) cluster.keys |= uint64_t(1) << key->second;
+                }
+            }
+            hierarchy.clusters.push_back(cluster);
+        }
+    }
+
+    // ключ се взима при първото стъпване в областта му, а това винаги е на ръба ѝ
+    for (size_t i = 0; i < height; i++) {
+        for (size_t j = 0; j < width; j++) {
+            Coord curr(i, j);
+            if (type_at(curr) != PixelType::KEY) continue;
+
+            Color clr = color_at(curr);
+            bool border = false;
+            for (int di = -1; di < 2; di++) {
+                for (int dj = -1; dj < 2; dj++) {
+                    if ((di == 0 && dj == 0) || (di != 0 && dj != 0)) continue;
+
+                    Coord nb = curr + Coord(di, dj);
+                    if (is_valid(nb) && (type_at(nb) != PixelType::KEY || color_at(nb) != clr)) border = true;
+                }
+            }
+            if (border) hierarchy_node(curr);
+        }
+    }
+
+    // Every run of open pixel pairs across a cluster border gets a transition in the middle, long runs one at
+    // each end. Runs are split where a side changes from one colored area to another, so zones and keys get
+    // their own transitions.
+    auto same_kind = [&](const Coord& a, const Coord& b) {
+        return type_at(a) == type_at(b) && (type_at(a) == PixelType::FREE || color_at(a) == color_at(b));
+    };
+    auto link_at = [&](const Coord& a0, const Coord& b0, const Coord& along, size_t k) {
+        Coord a(a0.row + along.row * k, a0.col + along.col * k);
+        Coord b(b0.row + along.row * k, b0.col + along.col * k);
+        link_nodes(a, b, cost(color_at(b)), cost(color_at(a)));
+    };
+    auto link_run = [&](const Coord& a0, const Coord& b0, const Coord& along, size_t first, size_t last) {
+        if (last - first + 1 > 6) {
+            link_at(a0, b0, along, first);
+            link_at(a0, b0, along, last);
+        }
+        else {
+            link_at(a0, b0, along, first + (last - first + 1) / 2);
+        }
+    };
+    auto scan_border = [&](const Coord& a0, const Coord& b0, const Coord& along, size_t length) {
+        size_t run = length;
+        for (size_t k = 0; k <= length; k++) {
+            Coord a(a0.row + along.row * k, a0.col + along.col * k);
+            Coord b(b0.row + along.row * k, b0.col + along.col * k);
+            bool open = k < length && type_at(a) != PixelType::WALL && type_at(b) != PixelType::WALL;
+
+            if (run != length && (!open || !same_kind(a, Coord(a.row - along.row, a.col - along.col)) ||
+                !same_kind(b, Coord(b.row - along.row, b.col - along.col))))
+            {
+                link_run(a0, b0, along, run, k - 1);
+                run = length;
+            }
+            if (open && run == length) run = k;
+        }
+    };
+
+    for (size_t cr = 0; cr < cluster_rows; cr++) {
+        for (size_t cc = 0; cc < hierarchy.cluster_cols; cc++) {
+            const Hierarchy::Cluster& cluster = hierarchy.clusters[cr * hierarchy.cluster_cols + cc];
+            if (cluster.right + 1 < width) {
+                scan_border(Coord(cluster.top, cluster.right), Coord(cluster.top, cluster.right + 1), Coord(1, 0),
+                    cluster.bottom - cluster.top + 1);
+            }
+            if (cluster.bottom + 1 < height) {
+                scan_border(Coord(cluster.bottom, cluster.left), Coord(cluster.bottom + 1, cluster.left), Coord(0, 1),
+                    cluster.right - cluster.left + 1);
+            }
+        }
+    }
+
+    // клъстерите с малко ключове се смятат за всичките им подмножества, останалите - при нужда
+    for (size_t c = 0; c < hierarchy.clusters.size(); c++) {
+        uint64_t cluster_keys = hierarchy.clusters[c].keys;
+        size_t count = 0;
+        for (uint64_t k = cluster_keys; k != 0; k &= k - 1) count++;
+        if (count > MAX_CLUSTER_KEYS) continue;
+
+        uint64_t subset = cluster_keys;
+        while (true) {
+            cluster_legs(c, subset, cost);
+            if (subset == 0) break;
+            subset = (subset - 1) & cluster_keys;
+        }
+    }
+
+    hierarchy.built = true;
+}
+
+template void Maze::build_hierarchy<Maze::GreyCost>(const GreyCost& cost, size_t cluster_size);
+template void Maze::build_hierarchy<Maze::UniformCost>(const UniformCost& cost, size_t cluster_size);
+template void Maze::build_hierarchy<Maze::LutCost>(const LutCost& cost, size_t cluster_size);
+
+size_t Maze::hierarchy_nodes() const {
+    return hierarchy.built ? hierarchy.nodes.size() : 0;
+}
+
+template<class CostModel>
+Maze::Coord Maze::cluster_search(const Hierarchy::Cluster& cluster, const Coord& from, uint64_t mask,
+    const CostModel& cost, size_t& end_cost)
+{
+    using DistIndx = std::pair<size_t, size_t>;
+
+    size_t cluster_width = cluster.right - cluster.left + 1;
+    size_t area = cluster_width * (cluster.bottom - cluster.top + 1);
+    PoolVector<size_t>& dists = ws->cluster_dists;
+    PoolVector<uint32_t>& parents = ws->cluster_parents;
+    dists.assign(area, MAX_DIST);
+    parents.assign(area, NO_CELL);
+
+    PoolVector<DistIndx>& heap = ws->heap;
+    std::greater<DistIndx> cmp;
+    heap.clear();
+
+    size_t first = (from.row - cluster.top) * cluster_width + from.col - cluster.left;
+    dists[first] = 0;
+    heap.push_back(DistIndx(0, first));
+
+    Coord end;
+    end_cost = MAX_DIST;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), cmp);
+        DistIndx curr = heap.back();
+        heap.pop_back();
+        if (curr.first > dists[curr.second]) continue;
+
+        Coord c(cluster.top + curr.second / cluster_width, cluster.left + curr.second % cluster_width);
+        PixelType type = type_at(c);
+        if (type == PixelType::END && end_cost == MAX_DIST) {
+            end = c;
+            end_cost = curr.first;
+        }
+
+        // ключ, който нямаме, се взима в абстрактния граф - тук пътят спира на него
+        if (type == PixelType::KEY && curr.second != first && !has_key(c, mask)) continue;
+
+        for (int i = -1; i < 2; i++) {
+            for (int j = -1; j < 2; j++) {
+                if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+                // извън клъстера редът или колоната се превърта и стават по-големи от края му
+                Coord nb = c + Coord(i, j);
+                if (nb.row < cluster.top || nb.row > cluster.bottom || nb.col < cluster.left || nb.col > cluster.right) continue;
+
+                PixelType nb_type = type_at(nb);
+                if (nb_type == PixelType::WALL) continue;
+                if (nb_type == PixelType::ZONE && !has_key(nb, mask)) continue;
+
+                size_t g = curr.first + cost(color_at(nb));
+                size_t local = (nb.row - cluster.top) * cluster_width + nb.col - cluster.left;
+                if (g < dists[local]) {
+                    dists[local] = g;
+                    parents[local] = (uint32_t)curr.second;
+                    heap.push_back(DistIndx(g, local));
+                    std::push_heap(heap.begin(), heap.end(), cmp);
+                }
+            }
+        }
+    }
+    return end;
+}
+
+template<class CostModel>
+const Maze::Hierarchy::Legs& Maze::cluster_legs(size_t cluster_indx, uint64_t mask, const CostModel& cost) {
+    Hierarchy::Cluster& cluster = hierarchy.clusters[cluster_indx];
+    mask &= cluster.keys;
+
+    std::unordered_map<uint64_t, Hierarchy::Legs>::iterator it = cluster.legs.find(mask);
+    if (it != cluster.legs.end()) return it->second;
+
+    size_t cluster_width = cluster.right - cluster.left + 1;
+    size_t count = cluster.nodes.size();
+    Hierarchy::Legs legs;
+    legs.to.resize(count);
+    legs.end_cost.assign(count, MAX_DIST);
+    legs.end.resize(count);
+
+    for (size_t i = 0; i < count; i++) {
+        const Hierarchy::Node& from = hierarchy.nodes[cluster.nodes[i]];
+        // от ключ, който още нямаме, не се тръгва - първо се взима
+        if (from.key != NO_LAYER && !((mask >> from.key) & 1)) continue;
+
+        legs.end[i] = cluster_search(cluster, from.coord, mask, cost, legs.end_cost[i]);
+        for (size_t j = 0; j < count; j++) {
+            if (j == i) continue;
+
+            const Coord& to = hierarchy.nodes[cluster.nodes[j]].coord;
+            size_t dist = ws->cluster_dists[(to.row - cluster.top) * cluster_width + to.col - cluster.left];
+            if (dist != MAX_DIST) legs.to[i].push_back(std::pair<size_t, size_t>(cluster.nodes[j], dist));
+        }
+    }
+
+    return cluster.legs.emplace(mask, std::move(legs)).first->second;
+}
+
+void Maze::trace_cluster(const Hierarchy::Cluster& cluster, const Coord& from, const Coord& to,
+    std::vector<Coord>& path) const
+{
+    size_t cluster_width = cluster.right - cluster.left + 1;
+    size_t first = (from.row - cluster.top) * cluster_width + from.col - cluster.left;
+    size_t curr = (to.row - cluster.top) * cluster_width + to.col - cluster.left;
+
+    while (curr != first) {
+        if (ws->cluster_parents[curr] == NO_CELL) {
+            throw MazeException("ERROR: Leg of the hierarchical path is missing.");
+        }
+        curr = ws->cluster_parents[curr];
+        path.push_back(Coord(cluster.top + curr / cluster_width, cluster.left + curr % cluster_width));
+    }
+}
+
+Maze::PathResult Maze::find_path_hierarchical() {
+    return find_path_hierarchical(GreyCost());
+}
+
+template<class CostModel>
+Maze::PathResult Maze::find_path_hierarchical(const CostModel& cost) {
+    begin_solve();
+    build_hierarchy(cost, hierarchy.built ? hierarchy.cluster_size : DEFAULT_CLUSTER_SIZE);
+
+    using Step = Workspace::HierarchyStep;
+    using DistStep = std::pair<size_t, size_t>;
+
+    PoolVector<Step>& steps = ws->hierarchy_steps;
+    PoolVector<size_t>& node_steps = ws->node_steps;
+    PoolVector<DistStep>& open = ws->hierarchy_open;
+    std::greater<DistStep> cmp;
+    steps.clear();
+    node_steps.assign(hierarchy.nodes.size(), NO_LAYER);
+    open.clear();
+
+    auto relax = [&](size_t node, uint64_t mask, size_t g, size_t parent) {
+        size_t s = node_steps[node];
+        while (s != NO_LAYER && steps[s].mask != mask) s = steps[s].next;
+
+        if (s == NO_LAYER) {
+            s = steps.size();
+            steps.push_back(Step(node, mask, g, parent, node_steps[node]));
+            node_steps[node] = s;
+        }
+        else if (g < steps[s].g) {
+            steps[s].g = g;
+            steps[s].parent = parent;
+        }
+        else {
+            return;
+        }
+        open.push_back(DistStep(g, s));
+        std::push_heap(open.begin(), open.end(), cmp);
+    };
+
+    PathResult res;
+    Coord start = get_start();
+    size_t start_cluster = (start.row / hierarchy.cluster_size) * hierarchy.cluster_cols + start.col / hierarchy.cluster_size;
+    const Hierarchy::Cluster& first = hierarchy.clusters[start_cluster];
+    size_t first_width = first.right - first.left + 1;
+
+    size_t best = MAX_DIST;
+    size_t best_step = NO_LAYER;
+    size_t end_cost;
+    Coord best_end = cluster_search(first, start, 0, cost, end_cost);
+    if (end_cost != MAX_DIST) best = end_cost;
+
+    for (std::vector<size_t>::const_iterator it = first.nodes.begin(); it != first.nodes.end(); it++) {
+        const Coord& c = hierarchy.nodes[*it].coord;
+        size_t dist = ws->cluster_dists[(c.row - first.top) * first_width + c.col - first.left];
+        if (dist != MAX_DIST) relax(*it, 0, dist, NO_LAYER);
+    }
+
+    while (!open.empty()) {
+        std::pop_heap(open.begin(), open.end(), cmp);
+        DistStep curr = open.back();
+        open.pop_back();
+
+        Step step = steps[curr.second];
+        if (curr.first > step.g) continue;
+        if (step.g >= best) break;
+
+        const Hierarchy::Node& node = hierarchy.nodes[step.node];
+        if (node.key != NO_LAYER && !((step.mask >> node.key) & 1)) {
+            relax(step.node, step.mask | (uint64_t(1) << node.key), step.g, curr.second);
+            continue;
+        }
+
+        const Hierarchy::Legs& legs = cluster_legs(node.cluster, step.mask, cost);
+        if (legs.end_cost[node.local] != MAX_DIST && step.g + legs.end_cost[node.local] < best) {
+            best = step.g + legs.end_cost[node.local];
+            best_end = legs.end[node.local];
+            best_step = curr.second;
+        }
+
+        for (std::vector<std::pair<size_t, size_t>>::const_iterator it = legs.to[node.local].begin();
+            it != legs.to[node.local].end(); it++)
+        {
+            relax(it->first, step.mask, step.g + it->second, curr.second);
+        }
+        for (std::vector<std::pair<size_t, size_t>>::const_iterator it = node.links.begin(); it != node.links.end(); it++) {
+            const Coord& to = hierarchy.nodes[it->first].coord;
+            if (type_at(to) == PixelType::ZONE && !has_key(to, step.mask)) continue;
+
+            relax(it->first, step.mask, step.g + it->second, curr.second);
+        }
+    }
+
+    if (best == MAX_DIST) return res;
+    res.found = true;
+    res.cost = best;
+    res.end = best_end;
+
+    // уточняваме пътя отзад напред: всеки участък в клъстера се търси отново и се проследява
+    if (best_step == NO_LAYER) {
+        cluster_search(first, start, 0, cost, end_cost);
+        trace_cluster(first, start, best_end, res.path);
+        return res;
+    }
+
+    const Hierarchy::Node& last = hierarchy.nodes[steps[best_step].node];
+    cluster_search(hierarchy.clusters[last.cluster], last.coord, steps[best_step].mask, cost, end_cost);
+    trace_cluster(hierarchy.clusters[last.cluster], last.coord, best_end, res.path);
+
+    for (size_t s = best_step; ; s = steps[s].parent) {
+        const Hierarchy::Node& to = hierarchy.nodes[steps[s].node];
+        if (steps[s].parent == NO_LAYER) {
+            cluster_search(first, start, 0, cost, end_cost);
+            trace_cluster(first, start, to.coord, res.path);
+            break;
+        }
+
+        const Step& prev = steps[steps[s].parent];
+        const Hierarchy::Node& from = hierarchy.nodes[prev.node];
+        if (prev.node == steps[s].node) continue; // взет ключ
+
+        if (from.cluster != to.cluster) {
+            res.path.push_back(from.coord);
+        }
+        else {
+            const Hierarchy::Cluster& cluster = hierarchy.clusters[from.cluster];
+            cluster_search(cluster, from.coord, prev.mask, cost, end_cost);
+            trace_cluster(cluster, from.coord, to.coord, res.path);
+        }
+    }
+    return res;
+}
+
+template Maze::PathResult Maze::find_path_hierarchical<Maze::GreyCost>(const GreyCost& cost);
+template Maze::PathResult Maze::find_path_hierarchical<Maze::UniformCost>(const UniformCost& cost);
+template Maze::PathResult Maze::find_path_hierarchical<Maze::LutCost>(const LutCost& cost);
+
+// One scan over the colors, so the pixels don't have to be classified first
+template<class CostModel>
+size_t Maze::find_step_bounds(const CostModel& cost, const SearchLimits& limits) {
+    PoolVector<size_t>& rows = ws->row_steps;
+    PoolVector<size_t>& cols = ws->col_steps;
+    rows.assign(height + 1, MAX_DIST);
+    cols.assign(width + 1, MAX_DIST);
+    ws->end_boxes.clear();
+    ws->ends_seen.resize(width, height);
+
+    size_t min_cost = MAX_DIST;
+    for (size_t i = 0; i < height; i++) {
+        if (limits.stop()) return 0;
+
+        const unsigned char* bgr = pixels.data + i * pixels.stride;
+        for (size_t j = 0; j < width; j++, bgr += pixels.pixel_bytes) {
+            Color clr = { bgr[2], bgr[1], bgr[0] };
+            if (clr == WALL_COLOR) continue;
+
+            size_t c = cost(clr);
+            if (c < rows[i + 1]) rows[i + 1] = c;
+            if (c < cols[j + 1]) cols[j + 1] = c;
+            if (c < min_cost) min_cost = c;
+
+            if (clr != END_COLOR || ws->ends_seen.test(i, j)) continue;
+
+            Bitboard& area = ws->area;
+            RowRange area_rows(i, i);
+            area.set(i, j);
+            area.flood(ws->same_right, ws->same_down, area_rows);
+
+            std::pair<Coord, Coord> box(Coord(i, j), Coord(i, j));
+            area.for_each(area_rows, [&](size_t row, size_t col) {
+                ws->ends_seen.set(row, col);
+                if (box.first.row > row) box.first.row = row;
+                if (box.first.col > col) box.first.col = col;
+                if (box.second.row < row) box.second.row = row;
+                if (box.second.col < col) box.second.col = col;
+            });
+            area.clear_rows(area_rows);
+
+            ws->end_boxes.push_back(box);
+        }
+    }
+
+    // ред или колона само от стени не се пресича от никой път, там сумата не расте
+    rows[0] = cols[0] = 0;
+    for (size_t i = 1; i <= height; i++) {
+        rows[i] = rows[i - 1] + (rows[i] == MAX_DIST ? 0 : rows[i]);
+    }
+    for (size_t j = 1; j <= width; j++) {
+        cols[j] = cols[j - 1] + (cols[j] == MAX_DIST ? 0 : cols[j]);
+    }
+    return min_cost == MAX_DIST ? 0 : min_cost;
+}
+
+size_t Maze::end_heuristic(const Coord& c) const {
+    const PoolVector<size_t>& rows = ws->row_steps;
+    const PoolVector<size_t>& cols = ws->col_steps;
+
+    size_t res = MAX_DIST;
+    for (PoolVector<std::pair<Coord, Coord>>::const_iterator it = ws->end_boxes.begin(); it != ws->end_boxes.end(); it++) {
+        const Coord& top_left = it->first;
+        const Coord& bottom_right = it->second;
+
+        // стъпките към по-долните редове влизат в редовете след c.row, към по-горните - в тези преди него
+        size_t h = 0;
+        if (c.row < top_left.row) h += rows[top_left.row + 1] - rows[c.row + 1];
+        else if (c.row > bottom_right.row) h += rows[c.row] - rows[bottom_right.row];
+        if (c.col < top_left.col) h += cols[top_left.col + 1] - cols[c.col + 1];
+        else if (c.col > bottom_right.col) h += cols[c.col] - cols[bottom_right.col];
+
+        if (h < res) res = h;
+    }
+    return res == MAX_DIST ? 0 : res;
+}
+
+// An END is never expanded - going on from it can't reach a cheaper one - so it only updates goal. A state is
+// expanded once per pass; if it gets a smaller g after that, it waits in incons for the next pass.
+template<class CostModel>
+bool Maze::improve_path(const CostModel& cost, double epsilon, const SearchLimits& limits,
+    Workspace::State& goal, size_t& goal_g)
+{
+    using State = Workspace::State;
+    using OpenState = Workspace::OpenState;
+
+    PoolVector<OpenState>& open = ws->open;
+    std::greater<OpenState> cmp;
+
+    for (size_t expanded = 1; !open.empty(); expanded++) {
+        if (expanded % SearchLimits::CHECK_INTERVAL == 0 && limits.stop()) return false;
+
+        if (open.front().f >= goal_g) return true;
+
+        std::pop_heap(open.begin(), open.end(), cmp);
+        OpenState curr = open.back();
+        open.pop_back();
+
+        size_t curr_indx = pixel_indx(curr.state.coord);
+        if (curr.g > ws->get_dist(curr.state.layer, curr_indx)) continue;
+        if (ws->is_closed(curr.state.layer, curr_indx)) continue;
+        ws->close(curr.state.layer, curr_indx);
+
+        for (int i = -1; i < 2; i++) {
+            for (int j = -1; j < 2; j++) {
+                if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+                Coord nb = curr.state.coord + Coord(i, j);
+                size_t new_layer;
+                if (!step_to(nb, curr.state.layer, new_layer)) continue;
+
+                size_t g = curr.g + cost(color_at(nb));
+                size_t nb_indx = pixel_indx(nb);
+                if (ws->get_dist(new_layer, nb_indx) <= g) continue;
+
+                size_t h = end_heuristic(nb);
+                if (g + h >= goal_g) continue;
+
+                ws->set_dist(new_layer, nb_indx, g);
+                ws->set_parent(new_layer, nb_indx, (uint64_t(curr.state.layer) << 32) | curr_indx);
+
+                if (type_at(nb) == PixelType::END) {
+                    if (g < goal_g) {
+                        goal_g = g;
+                        goal = State(nb, new_layer);
+                    }
+                    continue;
+                }
+
+                if (ws->is_closed(new_layer, nb_indx)) {
+                    ws->incons.push_back(State(nb, new_layer));
+                    continue;
+                }
+
+                double f = g + epsilon * h;
+                open.push_back(OpenState(f, g, State(nb, new_layer)));
+                std::push_heap(open.begin(), open.end(), cmp);
+            }
+        }
+    }
+
+    return true;
+}
+
+Maze::AnytimeResult Maze::find_path_anytime(const SearchLimits& limits, double epsilon) {
+    return find_path_anytime(limits, GreyCost(), epsilon);
+}
+
+template<class CostModel>
+Maze::AnytimeResult Maze::find_path_anytime(const SearchLimits& limits, const CostModel& cost, double epsilon) {
+    using State = Workspace::State;
+    using OpenState = Workspace::OpenState;
+
+    begin_solve();
+    AnytimeResult res;
+
+    if (epsilon < 1) epsilon = 1;
+
+    // първият път е този с най-малко стъпки - BFS спира при първия изход и е много по-бързо от точното търсене
+    if (!find_path(UniformCost(), std::true_type(), limits, true)) return res;
+
+    PathResult first = get_path();
+    res.iterations = 1;
+    res.epsilon = std::numeric_limits<double>::infinity();
+    if (!first.found) {
+        // всичко достижимо е обходено без изход - път няма
+        res.optimal = true;
+        return res;
+    }
+
+    res.found = true;
+    res.end = first.end;
+    res.path.swap(first.path);
+    res.cost = cost(color_at(res.end));
+    for (size_t i = 0; i + 1 < res.path.size(); i++) {
+        res.cost += cost(color_at(res.path[i]));
+    }
+    res.bound = std::numeric_limits<double>::infinity();
+
+    // h се подготвя след първия път, така той идва възможно най-рано
+    size_t min_cost = find_step_bounds(cost, limits);
+    if (limits.stop()) return res;
+
+    // никой път няма по-малко стъпки, а всяка струва поне min_cost; h от началото също е долна граница
+    Coord start = get_start();
+    size_t steps_bound = std::max(res.path.size() * min_cost, end_heuristic(start));
+    res.bound = (double)res.cost / steps_bound;
+    if (res.bound <= 1) {
+        res.optimal = true;
+        res.bound = 1;
+        return res;
+    }
+
+    begin_search();
+    size_t start_layer = comb_layer(START_KEY_COMB);
+    ws->set_dist(start_layer, pixel_indx(start), 0);
+    ws->set_parent(start_layer, pixel_indx(start), NO_PARENT);
+
+    PoolVector<OpenState>& open = ws->open;
+    PoolVector<State>& incons = ws->incons;
+    std::greater<OpenState> cmp;
+    open.clear();
+    incons.clear();
+    open.push_back(OpenState(epsilon * end_heuristic(start), 0, State(start, start_layer)));
+
+    // goal_g започва от цената на първия път, така проходите не пускат състояния, които не могат да я подобрят
+    State goal;
+    size_t goal_g = res.cost;
+    for (bool first_pass = true; ; first_pass = false) {
+        ws->new_pass();
+        if (!first_pass) {
+            // отворените от предишния проход и подобрените след разширяването им продължават с новото epsilon
+            size_t kept = 0;
+            for (size_t i = 0; i < open.size(); i++) {
+                size_t g = ws->get_dist(open[i].state.layer, pixel_indx(open[i].state.coord));
+                if (open[i].g > g) continue;
+                open[kept++] = OpenState(g + epsilon * end_heuristic(open[i].state.coord), g, open[i].state);
+            }
+            open.resize(kept);
+            for (size_t i = 0; i < incons.size(); i++) {
+                size_t g = ws->get_dist(incons[i].layer, pixel_indx(incons[i].coord));
+                open.push_back(OpenState(g + epsilon * end_heuristic(incons[i].coord), g, incons[i]));
+            }
+            incons.clear();
+            std::make_heap(open.begin(), open.end(), cmp);
+        }
+
+        // прекъснат проход също може да е намерил по-добър път, а границата по-долу важи по всяко време
+        bool finished = improve_path(cost, epsilon, limits, goal, goal_g);
+        if (finished) {
+            res.iterations++;
+            res.epsilon = epsilon;
+        }
+
+        if (goal_g < res.cost) {
+            res.end = goal.coord;
+            res.path.clear();
+
+            // по родителите - разстоянията на прохода не винаги са точни
+            uint64_t parent = ws->get_parent(goal.layer, pixel_indx(goal.coord));
+            while (parent != NO_PARENT) {
+                size_t indx = parent & 0xFFFFFFFF;
+                res.path.push_back(coord_at(indx));
+                parent = ws->get_parent(parent >> 32, indx);
+            }
+
+            res.cost = cost(color_at(goal.coord));
+            for (size_t i = 0; i + 1 < res.path.size(); i++) {
+                res.cost += cost(color_at(res.path[i]));
+            }
+            goal_g = res.cost;
+        }
+
+        // никой път не е по-евтин от най-малкото g + h сред чакащите състояния
+        size_t lower_bound = goal_g;
+        for (PoolVector<OpenState>::iterator it = open.begin(); it != open.end(); it++) {
+            size_t f = it->g + end_heuristic(it->state.coord);
+            if (f < lower_bound) lower_bound = f;
+        }
+        for (PoolVector<State>::iterator it = incons.begin(); it != incons.end(); it++) {
+            size_t f = ws->get_dist(it->layer, pixel_indx(it->coord)) + end_heuristic(it->coord);
+            if (f < lower_bound) lower_bound = f;
+        }
+        if (lower_bound < steps_bound) lower_bound = steps_bound;
+
+        double bound = (double)res.cost / lower_bound;
+        if (finished && epsilon < bound) bound = epsilon;
+        if (bound < res.bound) res.bound = bound;
+        if (!finished) break;
+
+        if (epsilon == 1 || (open.empty() && incons.empty())) {
+            res.optimal = true;
+            res.bound = 1;
+            break;
+        }
+
+        // намаляваме epsilon наполовина към 1
+        epsilon = 1 + (epsilon - 1) / 2;
+        if (epsilon < 1.05) epsilon = 1;
+    }
+
+    return res;
+}
+
+template Maze::AnytimeResult Maze::find_path_anytime<Maze::GreyCost>(const SearchLimits& limits, const GreyCost& cost, double epsilon);
+template Maze::AnytimeResult Maze::find_path_anytime<Maze::UniformCost>(const SearchLimits& limits, const UniformCost& cost, double epsilon);
+template Maze::AnytimeResult Maze::find_path_anytime<Maze::LutCost>(const SearchLimits& limits, const LutCost& cost, double epsilon);
+
+void Maze::build_exit_field(DistanceField& field) {
+    build_exit_field(field, GreyCost());
+}
+
+void Maze::field_key_sets(std::vector<char>& held) {
+    size_t layers = size_t(1) << keys.size();
+    held.assign(layers, 0);
+    held[0] = 1;
+    for (size_t k = 0; k < keys.size(); k++) {
+        held[size_t(1) << k] = 1;
+    }
+
+    using State = Workspace::State;
+
+    PoolVector<uint32_t>& marks = ws->field_marks;
+    marks.assign(width * height, 0);
+    RingQueue<State>& wave = ws->wave;
+
+    // S | k е по-голямо от S, затова всяко S е готово, преди да стигнем до него
+    for (size_t s = 1; s < layers; s++) {
+        if (!held[s]) continue;
+
+        // разходката със S стои някъде в областта на последния си ключ
+        for (size_t indx = 0; indx < width * height; indx++) {
+            Coord c(indx / width, indx % width);
+            if (type_at(c) == PixelType::KEY && ((s >> ws->pixel_keys[indx]) & 1)) {
+                marks[indx] = uint32_t(s + 1);
+                wave.push(State(c, s));
+            }
+        }
+
+        while (!wave.empty()) {
+            Coord curr = wave.front().coord;
+            wave.pop();
+
+            for (int i = -1; i < 2; i++) {
+                for (int j = -1; j < 2; j++) {
+                    if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+                    Coord nb = curr + Coord(i, j);
+                    if (!is_valid(nb)) continue;
+
+                    size_t nb_indx = field_indx(nb);
+                    PixelType nb_type = type_at(nb);
+                    if (marks[nb_indx] == s + 1 || nb_type == PixelType::WALL) continue;
+
+                    if (nb_type == PixelType::KEY || nb_type == PixelType::ZONE) {
+                        size_t key = ws->pixel_keys[nb_indx];
+                        if (key == NO_LAYER) continue;
+
+                        // ключ, който нямаме, не се прекосява - стъпвайки на него, минаваме в S с ключа
+                        if (!((s >> key) & 1)) {
+                            if (nb_type == PixelType::KEY) held[s | (size_t(1) << key)] = 1;
+                            continue;
+                        }
+                    }
+
+                    marks[nb_indx] = uint32_t(s + 1);
+                    wave.push(State(nb, s));
+                }
+            }
+        }
+    }
+}
+
+template<class CostModel>
+void Maze::build_exit_field(DistanceField& field, const CostModel& cost) {
+    begin_solve();
+    classify_all();
+    if (keys.size() > MAX_FIELD_KEYS) {
+        throw MazeException("ERROR: Too many keys for a distance field.");
+    }
+
+    size_t layers = size_t(1) << keys.size();
+    field.resize(width, height, layers);
+
+    // стойностите на слоя се смятат тук в пълен размер, а полето пази сгъстено копие
+    PoolVector<uint32_t>& dists = ws->field_dists;
+    dists.assign(width * height, 0);
+
+    PoolVector<size_t>& pixel_keys = ws->pixel_keys;
+    pixel_keys.assign(width * height, NO_LAYER);
+    for (size_t i = 0; i < height; i++) {
+        for (size_t j = 0; j < width; j++) {
+            Coord curr(i, j);
+            size_t indx = field_indx(curr);
+            PixelType type = type_at(curr);
+            if (type == PixelType::WALL) continue;
+
+            Color clr = color_at(curr);
+            dists[indx] = (uint32_t)cost(clr);
+            if (type == PixelType::KEY || type == PixelType::ZONE) {
+                std::unordered_map<Color, size_t, Color::Hasher>::iterator key = keys.find(clr);
+                if (key != keys.end()) pixel_keys[indx] = key->second;
+            }
+        }
+    }
+    field.set_step_costs(dists.data());
+
+    std::vector<char> held;
+    field_key_sets(held);
+
+    using DistIndx = std::pair<size_t, size_t>;
+    PoolVector<DistIndx>& heap = ws->heap;
+    std::greater<DistIndx> cmp;
+
+    // слоевете с повече ключове се смятат първи - от слой s се минава само в негови надмножества
+    for (size_t s = layers; s-- > 0;) {
+        if (!held[s]) continue;
+
+        dists.assign(width * height, DistanceField::UNREACHABLE);
+        heap.clear();
+        for (size_t indx = 0; indx < width * height; indx++) {
+            PixelType type = type_at(Coord(indx / width, indx % width));
+            if (type == PixelType::END) {
+                dists[indx] = 0;
+                heap.push_back(DistIndx(0, indx));
+            }
+            else if (type == PixelType::KEY && !((s >> pixel_keys[indx]) & 1)) {
+                // стъпвайки на ключ, който нямаме, минаваме в слоя с него
+                uint32_t dist = field.dist(s | (size_t(1) << pixel_keys[indx]), indx);
+                if (dist != DistanceField::UNREACHABLE) heap.push_back(DistIndx(dist, indx));
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), cmp);
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), cmp);
+            DistIndx curr = heap.back();
+            heap.pop_back();
+
+            // разстоянията на полето са ред по ред, независимо от подредбата на пикселите
+            Coord c(curr.second / width, curr.second % width);
+            bool new_key = type_at(c) == PixelType::KEY && !((s >> pixel_keys[curr.second]) & 1);
+            if (!new_key && curr.first > dists[curr.second]) continue;
+
+            // от съседа до текущия пиксел се стига с цената на текущия
+            size_t dist = curr.first + field.step_cost(curr.second);
+            if (dist >= DistanceField::UNREACHABLE) continue;
+
+            for (int i = -1; i < 2; i++) {
+                for (int j = -1; j < 2; j++) {
+                    if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+                    Coord nb = c + Coord(i, j);
+                    if (!is_valid(nb)) continue;
+
+                    // съседът трябва да е състояние от слоя: не стена, а зоните и ключовете - с ключ от s
+                    size_t nb_indx = field_indx(nb);
+                    PixelType nb_type = type_at(nb);
+                    if (nb_type == PixelType::WALL) continue;
+                    if ((nb_type == PixelType::KEY || nb_type == PixelType::ZONE) &&
+                        (pixel_keys[nb_indx] == NO_LAYER || !((s >> pixel_keys[nb_indx]) & 1))) continue;
+
+                    if (dist < dists[nb_indx]) {
+                        dists[nb_indx] = (uint32_t)dist;
+                        heap.push_back(DistIndx(dist, nb_indx));
+                        std::push_heap(heap.begin(), heap.end(), cmp);
+                    }
+                }
+            }
+        }
+
+        field.set_layer(s, dists.data());
+    }
+}
+
+template void Maze::build_exit_field<Maze::GreyCost>(DistanceField& field, const GreyCost& cost);
+template void Maze::build_exit_field<Maze::UniformCost>(DistanceField& field, const UniformCost& cost);
+template void Maze::build_exit_field<Maze::LutCost>(DistanceField& field, const LutCost& cost);
+
+template<class CostModel>
+bool Maze::build_exit_field_cached(ResultCache& cache, DistanceField& field, const CostModel& cost) {
+    begin_solve();
+    uint64_t key = hash_mix(hash_mix(pixels_hash, cost.hash()), 'F');
+
+    // ключовете трябва да са номерирани както при строенето на полето, за да се четат слоевете му
+    classify_all();
+    if (cache.load_field(key, field, width, height, size_t(1) << keys.size())) return true;
+
+    build_exit_field(field, cost);
+    cache.store_field(key, field);
+    return false;
+}
+
+template bool Maze::build_exit_field_cached<Maze::GreyCost>(ResultCache& cache, DistanceField& field, const GreyCost& cost);
+template bool Maze::build_exit_field_cached<Maze::UniformCost>(ResultCache& cache, DistanceField& field, const UniformCost& cost);
+template bool Maze::build_exit_field_cached<Maze::LutCost>(ResultCache& cache, DistanceField& field, const LutCost& cost);
+
+size_t Maze::field_layer(const Coord& c) const {
+    if (type_at(c) != PixelType::KEY) return 0;
+
+    return size_t(1) << keys.find(color_at(c))->second;
+}
+
+size_t Maze::exit_cost(const DistanceField& field, const Coord& c) const {
+    check_workspace();
+    uint32_t dist = field.dist(field_layer(c), field_indx(c));
+    return dist == DistanceField::UNREACHABLE ? MAX_DIST : dist;
+}
+
+std::vector<Maze::Coord> Maze::exit_path(const DistanceField& field, const Coord& c) const {
+    check_workspace();
+    std::vector<Coord> path;
+
+    Coord curr = c;
+    size_t layer = field_layer(c);
+    uint32_t dist = field.dist(layer, field_indx(c));
+    if (dist == DistanceField::UNREACHABLE) return path;
+
+    path.push_back(curr);
+    while (dist != 0) {
+        // следващият пиксел е съсед, чиято дистанция плюс цената да стъпим на него е точно текущата
+        bool moved = false;
+        for (int i = -1; i < 2 && !moved; i++) {
+            for (int j = -1; j < 2 && !moved; j++) {
+                if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+                Coord nb = curr + Coord(i, j);
+                if (!is_valid(nb)) continue;
+
+                PixelType nb_type = type_at(nb);
+                if (nb_type == PixelType::WALL) continue;
+
+                size_t nb_layer = layer;
+                if (nb_type == PixelType::KEY || nb_type == PixelType::ZONE) {
+                    std::unordered_map<Color, size_t, Color::Hasher>::const_iterator key = keys.find(color_at(nb));
+                    if (key == keys.end()) continue;
+
+                    if (nb_type == PixelType::KEY) {
+                        nb_layer |= size_t(1) << key->second;
+                    }
+                    else if (!((layer >> key->second) & 1)) {
+                        continue;
+                    }
+                }
+
+                size_t nb_indx = field_indx(nb);
+                uint32_t nb_dist = field.dist(nb_layer, nb_indx);
+                if (nb_dist != DistanceField::UNREACHABLE && nb_dist + field.step_cost(nb_indx) == dist) {
+                    curr = nb;
+                    layer = nb_layer;
+                    dist = nb_dist;
+                    moved = true;
+                }
+            }
+        }
+
+        if (!moved) {
+            throw MazeException("ERROR: Distance field doesn't match the maze.");
+        }
+        path.push_back(curr);
+    }
+
+    return path;
+}
+
+bool Maze::save_exit_heatmap(const DistanceField& field, Bitmap_Image& bmp_img, const std::string& filename) const {
+    check_workspace();
+    uint32_t max_dist = 0;
+    for (size_t i = 0; i < height; i++) {
+        for (size_t j = 0; j < width; j++) {
+            Coord curr(i, j);
+            uint32_t dist = field.dist(field_layer(curr), field_indx(curr));
+            if (dist != DistanceField::UNREACHABLE && dist > max_dist) max_dist = dist;
+        }
+    }
+
+    for (size_t i = 0; i < height; i++) {
+        for (size_t j = 0; j < width; j++) {
+            Coord curr(i, j);
+            uint32_t dist = field.dist(field_layer(curr), field_indx(curr));
+            if (dist == DistanceField::UNREACHABLE) continue;
+
+            unsigned char t = max_dist == 0 ? 0 : (unsigned char)(255.0 * dist / max_dist);
+            bmp_set_color_at(bmp_img, curr, Color(t, 0, 255 - t));
+        }
+    }
+
+    return bmp_img.save_file(filename);
+}
+
+void Maze::write_points(const std::vector<Coord>& path) {
+    PathWriter out(PathWriter::file_name(output_format), output_format);
+    for (std::vector<Coord>::const_iterator it = path.begin(); it != path.end(); it++) {
+        out.add(it->row, it->col);
+    }
+    out.close();
+}
+
+void Maze::write_points(const std::vector<Coord>& path, std::ostream& out_file) const {
+    PathWriter out(out_file, output_format);
+    for (std::vector<Coord>::const_iterator it = path.begin(); it != path.end(); it++) {
+        out.add(it->row, it->col);
+    }
+    out.close();
+}
+
+void Maze::trace_path(const Coord& end, std::vector<Coord>& path) {
+    if (contracted_dists) {
+        trace_contracted(end, path);
+        return;
+    }
+
+    Coord curr = end;
+    size_t layer = NO_LAYER;
+    while (true) {
+        PixelType type = type_at(curr);
+        size_t indx = pixel_indx(curr);
+
+        if (type == PixelType::START && key_combs[layer] == START_KEY_COMB) break;
+
+        if (type == PixelType::END) {
+            size_t min_dist = MAX_DIST;
+            for (size_t l = 0; l < key_combs.size(); l++) {
+                size_t dist = ws->get_dist(l, indx);
+                if (dist < min_dist) {
+                    layer = l;
+                    min_dist = dist;
+                }
+            }
+        }
+
+        // намираме съседа с минимална дистанция от тази комбинация
+        // ако сме в ключ с комбинация, която той няма, значи сме излезли от него и сме с 1 комбинация назад
+        // тогава цената на следващия пиксел с новата комбинация не зависи от тази на ключа(приемаме я за MAX_DIST)
+        Coord next = curr;
+        size_t min_dist = MAX_DIST;
+        if (type == PixelType::KEY) {
+            min_dist = ws->get_dist(layer, indx);
+        }
+        // UL U UR  L R  DL D DR
+        for (int i = -1; i < 2; i++) {
+            for (int j = -1; j < 2; j++) {
+                if ((i == 0 && j == 0) || (i != 0 && j != 0)) continue;
+
+                // взимаме съседния пиксел на текущия пиксел
+                Coord nb = curr + Coord(i, j);
+                if (!is_valid(nb)) continue;
+
+                // ако съседния пиксел има цена с текущата комбинация го обработваме
+                size_t dist = ws->get_dist(layer, pixel_indx(nb));
+                if (dist < min_dist) {
+                    next = nb;
+                    min_dist = dist;
+                }
+            }
+        }
+
+        // Ако няма съсед с по-малка дистанция:
+        //  - ако сме в ключ тогава махаме цвета на ключа от комбинацията и проверяваме тогава съседите
+        //  - ако сме в поле различно от ключ значи пряк няма път
+        if (next == curr) {
+            if (type == PixelType::KEY) {
+                KeyCombination kb = key_combs[layer].unset_at(keys[color_at(curr)]);
+                std::unordered_map<KeyCombination, size_t, KeyCombination::Hasher>::iterator it = comb_layers.find(kb);
+                if (it == comb_layers.end()) {
+                    throw MazeException("ERROR: Key combination without the key is missing.");
+                }
+                layer = it->second;
+            }
             else {
-                path.push_back(next);
-                bmp_set_color_at(bmp_img, next, PATH_COLOR);
-                curr = next;
+                throw MazeException("ERROR: There is no path, but ends[] is not empty.");
+            }
+        }
+        else {
+            path.push_back(next);
+            curr = next;
+        }
+    }
+}
+
+void Maze::trace_contracted(const Coord& end, std::vector<Coord>& path) {
+    size_t layer = NO_LAYER;
+    size_t min_dist = MAX_DIST;
+    for (size_t l = 0; l < key_combs.size(); l++) {
+        size_t dist = ws->get_dist(l, pixel_indx(end));
+        if (dist < min_dist) {
+            layer = l;
+            min_dist = dist;
+        }
+    }
+    if (layer == NO_LAYER) {
+        throw MazeException("ERROR: There is no path, but ends[] is not empty.");
+    }
+
+    Coord curr = end;
+    while (true) {
+        uint64_t parent = ws->get_parent(layer, pixel_indx(curr));
+        if (parent == NO_PARENT) break;
+
+        size_t parent_indx = parent & 0xFFFFFFFF;
+        size_t parent_layer = parent >> 32;
+        Coord to = coord_at(parent_indx);
+
+        // разгъваме реброто пиксел по пиксел - то винаги е по права линия
+        while (curr != to) {
+            if (curr.row < to.row) curr.row++;
+            else if (curr.row > to.row) curr.row--;
+            else if (curr.col < to.col) curr.col++;
+            else curr.col--;
+
+            path.push_back(curr);
+            if (type_at(curr) == PixelType::START && key_combs[parent_layer] == START_KEY_COMB) return;
+        }
+        layer = parent_layer;
+    }
+}
+
+void Maze::save_no_path() {
+    // двоичните формати без път са само заглавието
+    if (output_format == PathFormat::TEXT) {
+        std::ofstream out_file("output.txt", std::ios::trunc);
+        out_file << "no solution";
+        out_file.close();
+    }
+    else {
+        PathWriter(PathWriter::file_name(output_format), output_format).close();
+    }
+    std::cout << "There is no path.\n";
+}
+
+void Maze::save_path(Bitmap_Image& bmp_img) {
+    check_workspace();
+    if (ends.empty()) {
+        save_no_path();
+        return;
+    }
+
+    // всеки път се пише, докато се проследява следващият, и буферът се ползва отново
+    PathWriter out(PathWriter::file_name(output_format), output_format);
+    std::vector<Coord> path;
+    for (std::vector<Coord>::iterator end = ends.begin(); end != ends.end(); end++) {
+        bmp_set_color_at(bmp_img, *end, PATH_COLOR);
+        path.clear();
+        trace_path(*end, path);
+        for (std::vector<Coord>::const_iterator it = path.begin(); it != path.end(); it++) {
+            bmp_set_color_at(bmp_img, *it, PATH_COLOR);
+            out.add(it->row, it->col);
+        }
+    }
+
+    out.close();
+    bmp_img.save_file();
+}
+
+Maze::Solution Maze::get_solution() {
+    check_workspace();
+    Solution solution;
+    solution.ends = ends;
+
+    // save paths to every end
+    for (std::vector<Coord>::iterator end = ends.begin(); end != ends.end(); end++) {
+        trace_path(*end, solution.path);
+    }
+
+    solution.best = get_path();
+    return solution;
+}
+
+void Maze::save_solution(Bitmap_Image& bmp_img, const Solution& solution) {
+    if (solution.from_search && solution.cache == nullptr) {
+        save_path(bmp_img);
+        return;
+    }
+
+    if (solution.from_search) {
+        check_workspace();
+
+        // всеки път се проследява веднъж - докато се пише, влиза и в думите за кеша
+        std::vector<uint32_t> words;
+        if (solution.ends.empty()) {
+            pack_solution(solution, words, [](const Coord&) {});
+            save_no_path();
+        }
+        else {
+            PathWriter out(PathWriter::file_name(output_format), output_format);
+            for (std::vector<Coord>::const_iterator end = solution.ends.begin(); end != solution.ends.end(); end++) {
+                bmp_set_color_at(bmp_img, *end, PATH_COLOR);
+            }
+            pack_solution(solution, words, [&](const Coord& c) {
+                bmp_set_color_at(bmp_img, c, PATH_COLOR);
+                out.add(c.row, c.col);
+            });
+            out.close();
+            bmp_img.save_file();
+        }
+        solution.cache->store(solution.cache_key, words);
+        return;
+    }
+
+    if (solution.ends.empty()) {
+        save_no_path();
+        return;
+    }
+
+    for (std::vector<Coord>::const_iterator end = solution.ends.begin(); end != solution.ends.end(); end++) {
+        bmp_set_color_at(bmp_img, *end, PATH_COLOR);
+    }
+    for (std::vector<Coord>::const_iterator it = solution.path.begin(); it != solution.path.end(); it++) {
+        bmp_set_color_at(bmp_img, *it, PATH_COLOR);
+    }
+
+    write_points(solution.path);
+    bmp_img.save_file();
+}
+
+Maze::PathResult Maze::get_path() {
+    check_workspace();
+    PathResult res;
+    if (ends.empty()) return res;
+
+    // ends[] пази само първия достигнат пиксел от всяка изходна област, затова гледаме всички пиксели на областите
+    ws->ends_seen.for_each(RowRange(0, height - 1), [&](size_t row, size_t col) {
+        Coord end(row, col);
+        size_t indx = pixel_indx(end);
+        for (size_t l = 0; l < key_combs.size(); l++) {
+            size_t dist = ws->get_dist(l, indx);
+            if (dist != MAX_DIST && (!res.found || dist < res.cost)) {
+                res.found = true;
+                res.cost = dist;
+                res.end = end;
             }
         }
+    });
+
+    if (res.found) trace_path(res.end, res.path);
+    return res;
+}
+
+void Maze::paint_path(Bitmap_Image& bmp_img, const PathResult& res) const {
+    if (!res.found) return;
+
+    bmp_set_color_at(bmp_img, res.end, PATH_COLOR);
+    for (std::vector<Coord>::const_iterator it = res.path.begin(); it != res.path.end(); it++) {
+        bmp_set_color_at(bmp_img, *it, PATH_COLOR);
+    }
+}
+
+void Maze::save_path(Bitmap_Image& bmp_img, const PathResult& res) {
+    if (!res.found) {
+        save_no_path();
+        return;
     }
 
-    write_points(path);
+    paint_path(bmp_img, res);
+    write_points(res.path);
     bmp_img.save_file();
 }
\ No newline at end of file
@@ -8,6 +8,10 @@
 #include <unordered_map>
 #include <queue>
 #include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <chrono>
+#include <atomic>
 
 #include <fstream>
 
@@ -15,6 +19,12 @@
 // #include <math.h>
 
 #include "Bitmap.h"
+#include "Pool.h"
+#include "Bitboard.h"
+#include "DistanceField.h"
+#include "ResultCache.h"
+#include "WorkPool.h"
+#include "PathWriter.h"
 
 class MazeException : public std::exception {
 private:
@@ -28,8 +38,7 @@ public:
 };
 
 class Maze {
-private:
-    // Helper structs
+public:
     struct Coord {
         size_t row;
         size_t col;
@@ -83,6 +92,182 @@ private:
         };
     };
 
+    enum class PixelType : unsigned char {
+        UNSET,
+        WALL,
+        FREE,
+        KEY,
+        ZONE,
+        START,
+        END
+    };
+
+    // Order of the per-pixel arrays - pixel types, distances, parents. TILED keeps 8x8 blocks of pixels together,
+    // so a step up or down usually stays in the same cache line of the distances.
+    enum class Layout : unsigned char {
+        ROW_MAJOR,
+        TILED
+    };
+
+    // Caller-owned BGR (pixel_bytes = 3) or BGRA (pixel_bytes = 4) pixels, stride bytes between rows.
+    // The Maze only reads it and doesn't copy it, so it must outlive the solve.
+    struct PixelBuffer {
+        const unsigned char* data;
+        size_t width;
+        size_t height;
+        size_t stride;
+        size_t pixel_bytes;
+
+        PixelBuffer() : data(nullptr), width(0), height(0), stride(0), pixel_bytes(3) {}
+
+        PixelBuffer(const unsigned char* data, size_t width, size_t height, size_t stride, size_t pixel_bytes = 3) :
+            data(data), width(width), height(height), stride(stride), pixel_bytes(pixel_bytes) {}
+    };
+
+    // one step of the hash of the pixels and the solver options
+    static uint64_t hash_mix(uint64_t h, uint64_t value) {
+        h = (h ^ value) * 0x9E3779B97F4A7C15ULL;
+        return h ^ (h >> 32);
+    }
+
+    // Cost models for find_path. Every model maps the color of the pixel we step into to the cost of the step.
+    // IS_UNIFORM models are solved with a BFS that goes on with bitboards once it is big. The rest, GreyCost
+    // and so the default find_path too, use the weighted search on single pixels: even one-grey regions step
+    // into END pixels at another cost, so they can't be flooded level by level.
+    // hash() tells the result cache apart models that can give different paths.
+    struct GreyCost {
+        static const bool IS_UNIFORM = false;
+
+        size_t operator()(const Color& c) const {
+            return c.is_grey() ? c.red : 1;
+        }
+
+        uint64_t hash() const {
+            return hash_mix(1, 0);
+        }
+    };
+
+    struct UniformCost {
+        static const bool IS_UNIFORM = true;
+
+        size_t cost;
+
+        // a zero step would give every pixel the distance of the start and the paths couldn't be traced back
+        UniformCost(size_t cost = 1) : cost(cost) {
+            if (cost == 0) throw MazeException("ERROR: Step cost must be positive.");
+        }
+
+        size_t operator()(const Color&) const {
+            return cost;
+        }
+
+        uint64_t hash() const {
+            return hash_mix(2, cost);
+        }
+    };
+
+    struct LutCost {
+        static const bool IS_UNIFORM = false;
+
+        std::unordered_map<Color, size_t, Color::Hasher> costs;
+        size_t default_cost;
+
+        LutCost(size_t default_cost = 1) : default_cost(default_cost) {
+            if (default_cost == 0) throw MazeException("ERROR: Step cost must be positive.");
+        }
+
+        void set(const Color& c, size_t cost) {
+            if (cost == 0) throw MazeException("ERROR: Step cost must be positive.");
+            costs[c] = cost;
+        }
+
+        size_t operator()(const Color& c) const {
+            std::unordered_map<Color, size_t, Color::Hasher>::const_iterator it = costs.find(c);
+            return it == costs.end() ? default_cost : it->second;
+        }
+
+        // the order of the map isn't fixed, so the entries are summed
+        uint64_t hash() const {
+            uint64_t sum = 0;
+            for (std::unordered_map<Color, size_t, Color::Hasher>::const_iterator it = costs.begin(); it != costs.end(); it++) {
+                uint64_t clr = (uint64_t(it->first.red) << 16) | (uint64_t(it->first.green) << 8) | it->first.blue;
+                sum += hash_mix(hash_mix(0, clr), it->second);
+            }
+            return hash_mix(hash_mix(hash_mix(3, default_cost), sum), costs.size());
+        }
+    };
+
+    // Deadline and cancel token for find_path_anytime, checked every CHECK_INTERVAL expansions.
+    struct SearchLimits {
+        static const size_t CHECK_INTERVAL = 1024;
+
+        std::chrono::steady_clock::time_point deadline;
+        const std::atomic<bool>* cancel;
+
+        SearchLimits() : deadline(std::chrono::steady_clock::time_point::max()), cancel(nullptr) {}
+
+        SearchLimits(std::chrono::milliseconds budget, const std::atomic<bool>* cancel = nullptr) :
+            deadline(std::chrono::steady_clock::now() + budget), cancel(cancel) {}
+
+        bool stop() const {
+            return (cancel != nullptr && cancel->load(std::memory_order_relaxed)) ||
+                std::chrono::steady_clock::now() >= deadline;
+        }
+    };
+
+    struct PathResult {
+        bool found;
+        size_t cost;
+        Coord end;
+        std::vector<Coord> path; // from the step after end back to the start, like save_path
+
+        PathResult() : found(false), cost(0) {}
+    };
+
+    // Everything save_path writes, so a cached solve can be written out without searching.
+    struct Solution {
+        std::vector<Coord> ends; // the first reached pixel of every END area
+        std::vector<Coord> path; // the paths from every end, one after another
+        PathResult best;
+        bool from_search; // path is empty, the paths are traced from the search in the workspace when written
+        ResultCache* cache; // a solution from_search is stored here under cache_key once it is written
+        uint64_t cache_key;
+
+        Solution() : from_search(false), cache(nullptr), cache_key(0) {}
+    };
+
+    // Costs from every source to every target, row by row: costs[s * targets.size() + t].
+    struct BatchResult {
+        static const size_t NO_PATH = -1;
+
+        std::vector<Coord> sources;
+        std::vector<Coord> targets;
+        std::vector<size_t> costs;
+        size_t searches; // one per distinct source, or per distinct target if the batch searched backwards
+        double seconds;
+
+        BatchResult() : searches(0), seconds(0) {}
+
+        size_t cost(size_t source, size_t target) const {
+            return costs[source * targets.size() + target];
+        }
+
+        double queries_per_second() const {
+            return seconds > 0 ? costs.size() / seconds : 0;
+        }
+    };
+
+    struct AnytimeResult : PathResult {
+        bool optimal; // the search finished with epsilon 1
+        double bound; // cost <= bound * optimal cost, infinity if limits stopped the search before it was known
+        double epsilon; // epsilon of the last finished iteration, infinity for the BFS one
+        size_t iterations;
+
+        AnytimeResult() : optimal(false), bound(0), epsilon(0), iterations(0) {}
+    };
+
+private:
+    // Helper structs
     class KeyCombination {
     private:
         static const size_t CHAR_BITS = 8 * sizeof(char);
@@ -127,9 +312,21 @@ private:
             }
 
             key_comb.comb_bits[indx] &= ~(1 << ((CHAR_BITS - pos % CHAR_BITS) - 1));
+
+            // махаме празните байтове накрая, за да е равна на комбинацията преди set_at
+            while (key_comb.comb_bits.size() > 1 && key_comb.comb_bits.back() == 0) {
+                key_comb.comb_bits.pop_back();
+            }
             return key_comb;
         }
 
+        bool has(size_t pos) const {
+            size_t indx = pos / CHAR_BITS;
+            if (indx >= comb_bits.size()) return false;
+
+            return (comb_bits[indx] & (1 << ((CHAR_BITS - pos % CHAR_BITS) - 1))) != 0;
+        }
+
         bool operator==(const KeyCombination& key_comb) const {
             return comb_bits == key_comb.comb_bits;
         }
@@ -149,36 +346,241 @@ private:
         };
     };
 
-    struct Pixel {
-        struct umap_iterator_hasher {
-            size_t operator()(const std::unordered_set<KeyCombination, KeyCombination::Hasher>::iterator& i) const noexcept {
-                return std::hash<const KeyCombination*>()(&*i);
+    // Abstract graph of find_path_hierarchical. The maze is cut into square clusters; the nodes are transition
+    // pixels on the borders between clusters and the border pixels of KEY areas, where a key is picked up.
+    struct Hierarchy {
+        struct Node {
+            Coord coord;
+            size_t cluster;
+            size_t local; // indx in the nodes of its cluster
+            size_t key; // key indx of a KEY pixel, NO_LAYER for the rest
+            std::vector<std::pair<size_t, size_t>> links; // node in the next cluster and the cost of the step to it
+        };
+
+        // costs inside one cluster with one key set, from every node of the cluster
+        struct Legs {
+            std::vector<std::vector<std::pair<size_t, size_t>>> to; // node and cost
+            std::vector<size_t> end_cost; // cheapest END in the cluster, MAX_DIST if none
+            std::vector<Coord> end;
+        };
+
+        struct Cluster {
+            size_t top, left, bottom, right;
+            uint64_t keys; // keys with KEY or ZONE pixels in the cluster, the others don't change the legs
+            std::vector<size_t> nodes;
+            std::unordered_map<uint64_t, Legs> legs; // by key set, filled on first use
+        };
+
+        bool built;
+        size_t cluster_size;
+        size_t cluster_cols;
+        uint64_t cost_hash;
+        std::vector<Node> nodes;
+        std::unordered_map<size_t, size_t> node_of; // pixel indx -> node
+        std::vector<Cluster> clusters;
+
+        Hierarchy() : built(false), cluster_size(0), cluster_cols(0), cost_hash(0) {}
+    };
+
+public:
+    // Storage for the pixels and the search, kept between solves. Distances are stored per layer - one layer
+    // for every key combination - and are valid only if stamped with the current epoch, so reset() is O(1).
+    // A layer writes only the pages of the pixels it reaches, so a search that stops early doesn't pay for the rest.
+    // The bitboards of a layer are cleared the first time the layer is used in an epoch.
+    // One workspace can back several Maze objects, but only the one that loaded into it last can use it: the
+    // others throw MazeException until they load again.
+    class Workspace {
+    private:
+        friend class Maze;
+
+        struct Layer {
+            PoolVector<size_t> dists;
+            StampArray stamps;
+            PoolVector<uint64_t> parents; // of the contracted search: pixel indx and layer
+            StampArray closed; // pass of the anytime search that expanded the state
+
+            // wavefront of the bit-parallel BFS
+            Bitboard passable;
+            Bitboard new_keys; // keys the combination doesn't have
+            Bitboard visited;
+            Bitboard frontier;
+            Bitboard next;
+            WordList frontier_words;
+            WordList next_words;
+            uint32_t bits_epoch;
+
+            Layer(AllocStats* stats) :
+                dists(CountingAllocator<size_t>(stats)),
+                stamps(stats),
+                parents(CountingAllocator<uint64_t>(stats)),
+                closed(stats),
+                passable(stats),
+                new_keys(stats),
+                visited(stats),
+                frontier(stats),
+                next(stats),
+                frontier_words(CountingAllocator<uint32_t>(stats)),
+                next_words(CountingAllocator<uint32_t>(stats)),
+                bits_epoch(0) {}
+        };
+
+        struct State {
+            Coord coord;
+            size_t layer;
+
+            State() : layer(0) {}
+
+            State(const Coord& coord, size_t layer) : coord(coord), layer(layer) {}
+        };
+
+        // one color, so every step inside costs the same
+        struct Rect {
+            uint32_t top;
+            uint32_t left;
+            uint32_t bottom;
+            uint32_t right;
+
+            Rect(uint32_t top, uint32_t left, uint32_t bottom, uint32_t right) :
+                top(top), left(left), bottom(bottom), right(right) {}
+
+            bool contains(const Coord& c) const {
+                return c.row >= top && c.row <= bottom && c.col >= left && c.col <= right;
             }
         };
 
-        enum class Type {
-            UNSET,
-            WALL,
-            FREE,
-            KEY,
-            ZONE,
-            START,
-            END
+        struct OpenState {
+            double f;
+            size_t g;
+            State state;
+
+            OpenState() : f(0), g(0) {}
+
+            OpenState(double f, size_t g, const State& state) : f(f), g(g), state(state) {}
+
+            bool operator>(const OpenState& s) const {
+                return f > s.f || (f == s.f && g < s.g);
+            }
+        };
+
+        // state of the search over the abstract graph of the hierarchy: a node with a key set
+        struct HierarchyStep {
+            size_t node;
+            uint64_t mask;
+            size_t g;
+            size_t parent; // step it was reached from, NO_LAYER for the start
+            size_t next; // another step of the same node, NO_LAYER if none
+
+            HierarchyStep(size_t node, uint64_t mask, size_t g, size_t parent, size_t next) :
+                node(node), mask(mask), g(g), parent(parent), next(next) {}
         };
 
-        Maze::Color color;
-        Type type;
-        std::unordered_map<std::unordered_set<KeyCombination, KeyCombination::Hasher>::iterator, size_t, umap_iterator_hasher> key_dists; // key is the indx of keys combination, value - distance from this combination
+        AllocStats stats;
+        uint64_t loads; // mazes loaded so far, the owner is the one that loaded the last
+        uint32_t epoch;
+        uint32_t pass; // of the anytime search, for the closed stamps
+
+        size_t pixel_count;
+        PoolVector<unsigned char> bgr; // pixels copied from a bitmap
+        PoolVector<PixelType> types; // used if the caller doesn't give pre-classified pixels
+        PoolVector<Layer> layers;
+        RingQueue<State> wave;
+
+        Bitboard same_right; // pixel has the color of its right neighbour
+        Bitboard same_down; // pixel has the color of its down neighbour
+        Bitboard area;
+        Bitboard ends_seen;
+        Bitboard base_mask; // passable with any key combination
+        PoolVector<Bitboard> key_masks;
+        PoolVector<Bitboard> zone_masks;
+        PoolVector<std::pair<size_t, size_t>> heap; // distance and pixel indx
+        PoolVector<size_t> pixel_keys; // key indx of KEY and ZONE pixels
+        PoolVector<uint32_t> field_dists; // the layer of the exit field being built
+        PoolVector<uint32_t> field_marks; // key set + 1 of the walk that reached the pixel
+        PoolVector<OpenState> open;
+        PoolVector<State> incons; // improved after they were expanded in this pass of the anytime search
+        PoolVector<std::pair<Coord, Coord>> end_boxes; // bounding boxes of the END areas
+        PoolVector<size_t> row_steps; // row_steps[r] - sum of the cheapest steps into rows 0 to r - 1
+        PoolVector<size_t> col_steps; // the same for the columns
+        Bitboard batch_targets; // targets of the batch search not settled yet
+
+        // search state of the batch searches, swapped with layers, ends_seen and epoch while one runs
+        PoolVector<Layer> batch_layers;
+        Bitboard batch_ends_seen;
+        uint32_t batch_epoch;
+
+        // search inside one cluster of the hierarchy, indexed inside the cluster
+        PoolVector<size_t> cluster_dists;
+        PoolVector<uint32_t> cluster_parents;
+
+        // search over the abstract graph; a node has a few key sets, so its steps are chained from node_steps
+        PoolVector<HierarchyStep> hierarchy_steps;
+        PoolVector<size_t> node_steps; // node -> its last step, NO_LAYER if none
+        PoolVector<std::pair<size_t, size_t>> hierarchy_open; // g and step
+
+        // contracted graph
+        PoolVector<Rect> rects;
+        PoolVector<uint32_t> rect_of; // rect indx of every pixel, NO_RECT for walls
+        Bitboard stops; // border pixels of the rects that the search can't skip
+        Bitboard stops_t; // stops transposed, for moves along columns
+        Bitboard corridors; // FREE stops with two neighbours, passed through without entering the open list
+
+        void new_search();
+
+        Layer& layer_at(size_t layer);
+
+        size_t get_dist(size_t layer, size_t indx) const;
+
+        void set_dist(size_t layer, size_t indx, size_t dist);
+
+        // valid only where get_dist is
+        uint64_t get_parent(size_t layer, size_t indx) const;
+
+        void set_parent(size_t layer, size_t indx, uint64_t parent);
+
+        // starts a pass of the anytime search with every state open again
+        void new_pass();
+
+        bool is_closed(size_t layer, size_t indx) const;
+
+        void close(size_t layer, size_t indx);
+
+        void swap_batch_state();
+
+    public:
+        Workspace();
+
+        Workspace(const Workspace&) = delete;
+
+        Workspace& operator=(const Workspace&) = delete;
 
-        Pixel() : type(Type::UNSET) {}
+        void reset();
 
+        // Asks for transparent huge pages (Linux) for the blocks of 2 MiB and more allocated from now on -
+        // the distance layers and pixel arrays of big mazes. Elsewhere it has no effect.
+        void set_huge_pages(bool huge_pages);
+
+        // allocations and peak bytes of the last load or solve
+        const AllocStats& get_stats() const;
     };
 
+private:
+
 
     // Fields
     static const size_t MAX_DIST = -1;
     static const size_t KEY_WIDTH = 20;
     static const size_t KEY_HEIGHT = 20;
+    static const size_t NO_LAYER = -1;
+    static const size_t MAX_FIELD_KEYS = 8;
+    static const size_t MAX_PARALLEL_KEYS = 64; // key sets of the parallel and hierarchical searches are bit masks
+    static const size_t MAX_CLUSTER_KEYS = 4; // clusters with more keys get their legs on first use
+    static const size_t DEFAULT_CLUSTER_SIZE = 32;
+    static const size_t BITS_SHARE = 4; // the uniform BFS goes to bitboards past pixel_count / BITS_SHARE states
+    static const uint32_t NO_CELL = -1;
+    static const uint32_t NO_RECT = -1;
+    static const uint64_t NO_PARENT = -1;
+    static const size_t TILE_SHIFT = 3;
+    static const size_t TILE_MASK = (size_t(1) << TILE_SHIFT) - 1;
     static const Color WALL_COLOR;
     static const Color START_COLOR;
     static const Color END_COLOR;
@@ -186,23 +588,57 @@ private:
     static const KeyCombination START_KEY_COMB;
 
     size_t width, height;
+    uint64_t pixels_hash; // of the size and the colors, computed while loading
+
+    Layout requested_layout;
+    Layout layout;
+    size_t tile_cols;
+
+    PathFormat output_format;
+
+    PixelBuffer pixels;
+    PixelType* types;
 
     std::vector<Coord> ends;
     std::unordered_map<Color, size_t, Color::Hasher> keys; // color and indx
-    std::unordered_set<KeyCombination, KeyCombination::Hasher> key_combs;
-    std::vector<Pixel> pixels;
+    std::vector<KeyCombination> key_combs; // layer indx -> combination
+    std::unordered_map<KeyCombination, size_t, KeyCombination::Hasher> comb_layers; // combination -> layer indx
+    std::vector<std::vector<size_t>> comb_next; // layer indx and key indx -> layer with the key added
+
+    bool contracted; // the workspace has the contracted graph of this maze
+    bool contracted_dists; // the last search was over the contracted graph
+    bool classified; // every pixel has its type and every key its indx
+    bool masks_built; // the workspace has the bitboards of this maze
+    uint64_t load_id; // ws->loads after this maze was loaded
+
+    Hierarchy hierarchy;
+
+    Workspace own_workspace;
+    Workspace* ws;
+
+    // throws if another maze was loaded into the workspace since this one
+    void check_workspace() const;
+
+    // checks the workspace and starts counting the allocations of a new solve
+    void begin_solve();
 
     bool is_valid(const Coord& c) const;
 
+    // indx in the per-pixel arrays of the workspace, depends on the layout
     size_t pixel_indx(const Coord& c) const;
 
-    Pixel& pixel_at(const Coord& c);
+    Coord coord_at(size_t indx) const;
+
+    // indx in a DistanceField, always row by row
+    size_t field_indx(const Coord& c) const;
 
-    const Pixel& pixel_at(const Coord& c) const;
+    PixelType& type_at(const Coord& c);
 
-    Color bmp_color_at(const Bitmap_Image& bmp_img, const Coord& c);
+    PixelType type_at(const Coord& c) const;
 
-    void bmp_set_color_at(Bitmap_Image& bmp_img, const Coord& c, const Color& clr);
+    Color color_at(const Coord& c) const;
+
+    void bmp_set_color_at(Bitmap_Image& bmp_img, const Coord& c, const Color& clr) const;
 
     void print_pxl(const Coord& c) const;
 
@@ -214,19 +650,327 @@ private:
 
     void set_area_at(const Coord& c);
 
+    void load(PixelType* pre_classified);
+
+    // clears the ENDs found by the previous search
+    void begin_search();
+
+    size_t comb_layer(const KeyCombination& key_comb);
+
+    size_t layer_with_key(size_t layer, size_t key);
+
+    // false if limits stopped them, then they go on from where they were the next time
+    bool classify_all(const SearchLimits& limits = SearchLimits());
+
+    bool build_masks(const SearchLimits& limits = SearchLimits());
+
+    Workspace::Layer& bits_layer(size_t layer);
+
+    size_t field_layer(const Coord& c) const;
+
+    // Key sets of the exit field some walk can hold: none, any single key (a walk can start on it) and a held
+    // set with a key reachable from one of its keys. Needs pixel_keys.
+    void field_key_sets(std::vector<char>& held);
+
+    // appends the path from end back to the start, following the distances of the last search
+    void trace_path(const Coord& end, std::vector<Coord>& path);
+
+    void trace_contracted(const Coord& end, std::vector<Coord>& path);
+
+    void build_rects();
+
+    void mark_stops(const Coord& c, const Workspace::Rect& rect);
+
+    // calls f(nb, steps) for every neighbour of c in the contracted graph, steps pixels away in a straight line
+    template<class F>
+    void for_each_contracted(const Coord& c, F f) const;
+
+    // the different non-wall neighbours of c in the contracted graph, stops counting at 3
+    size_t corridor_neighbours(const Coord& c, Coord nbs[2], size_t steps[2]) const;
+
+    void save_no_path();
+
+    size_t hierarchy_node(const Coord& c);
+
+    // transition between neighbours in two clusters, with the cost of the step each way
+    void link_nodes(const Coord& a, const Coord& b, size_t cost_ab, size_t cost_ba);
+
+    // a ZONE or KEY pixel whose key is in mask
+    bool has_key(const Coord& c, uint64_t mask) const;
+
+    // Dijkstra from from inside cluster with the keys in mask into ws->cluster_dists and cluster_parents. KEY
+    // pixels of other keys are reached but not passed. Returns the cheapest END reached, Coord() if none.
+    template<class CostModel>
+    Coord cluster_search(const Hierarchy::Cluster& cluster, const Coord& from, uint64_t mask, const CostModel& cost,
+        size_t& end_cost);
+
+    template<class CostModel>
+    const Hierarchy::Legs& cluster_legs(size_t cluster, uint64_t mask, const CostModel& cost);
+
+    // appends the pixels from the parent of to back to from, following the last cluster_search
+    void trace_cluster(const Hierarchy::Cluster& cluster, const Coord& from, const Coord& to, std::vector<Coord>& path) const;
+
+    // A solution from_search gets its paths traced one end at a time, and visit is called with every pixel of
+    // them, so they can be written out in the same pass.
+    template<class Visit>
+    void pack_solution(const Solution& solution, std::vector<uint32_t>& words, Visit visit);
+
+    bool unpack_solution(const std::vector<uint32_t>& words, Solution& solution) const;
+
+    // Sums of the cheapest step into every row and column. Moving between rows r1 < r2 steps into each of the rows
+    // after r1 at least once, and the same for columns, so the sums bound the cost of any path from below.
+    // Also puts the bounding boxes of the END areas in ws->end_boxes. Returns the cheapest step of the whole maze,
+    // 0 if limits stopped it.
+    template<class CostModel>
+    size_t find_step_bounds(const CostModel& cost, const SearchLimits& limits);
+
+    // lower bound of the cost from c to the nearest END area, needs find_step_bounds
+    size_t end_heuristic(const Coord& c) const;
+
+    // One pass of the anytime search over ws->open: expands by g + epsilon * h until no open state can beat
+    // goal_g, and states that can't are not pushed. States improved after they were expanded in this pass go to
+    // ws->incons. False if limits stopped it.
+    template<class CostModel>
+    bool improve_path(const CostModel& cost, double epsilon, const SearchLimits& limits,
+        Workspace::State& goal, size_t& goal_g);
+
+    bool step_to(const Coord& nb, size_t curr_layer, size_t& new_layer);
+
+    // Batch searches run on the search state the workspace keeps for them while this lives, so the distances and
+    // ENDs of the last find_path are still there for get_path and save_path afterwards.
+    class BatchScope {
+    private:
+        Maze& maze;
+        std::vector<Coord> ends;
+        bool contracted_dists;
+
+    public:
+        BatchScope(Maze& maze);
+
+        ~BatchScope();
+
+        BatchScope(const BatchScope&) = delete;
+
+        BatchScope& operator=(const BatchScope&) = delete;
+    };
+
+    // Dijkstra from source with no keys, stops when the targets marked in batch_targets are settled.
+    // Sets the parents, so the path to any settled pixel can be traced back.
+    template<class CostModel>
+    void batch_search(const Coord& source, const CostModel& cost, size_t targets_left);
+
+    // Dijkstra back from target in a maze without keys: the distance of a pixel is the cost of the path from it to
+    // target. Stops when the sources marked in batch_targets are settled. Sets no parents.
+    template<class CostModel>
+    void batch_search_back(const Coord& target, const CostModel& cost, size_t sources_left);
+
+    // layer of the key set given as a bit mask, made if it doesn't exist
+    size_t mask_layer(uint64_t mask);
+
+    // One layer of find_path_parallel: Dijkstra from the states handed to it, inside its key set. Steps onto
+    // keys it doesn't have are handed to the layer with the key; END pixels it settles go to reached_ends.
+    template<class CostModel>
+    void layer_search(uint64_t mask, size_t layer, const CostModel& cost,
+        std::unordered_map<uint64_t, std::unique_ptr<HandoffStack<std::pair<size_t, size_t>>>>& handoffs,
+        std::vector<Coord>& reached_ends);
+
+    // min over the key combinations of the last search, MAX_DIST if not reached
+    size_t min_dist_at(const Coord& c, size_t& layer) const;
+
+    template<class CostModel>
+    void find_path(const CostModel& cost, std::false_type);
+
+    // False if limits stopped it, checked once per level. With to_first_end it stops after the level that
+    // reaches the first END, so only the nearest ends have their distances.
+    template<class CostModel>
+    bool find_path(const CostModel& cost, std::true_type, const SearchLimits& limits = SearchLimits(),
+        bool to_first_end = false);
+
+    // Goes on with the uniform BFS on bitboards from the states in wave, which are all at distance level.
+    template<class CostModel>
+    bool bits_search(const CostModel& cost, size_t level, const SearchLimits& limits, bool to_first_end);
+
 public:
-    Maze() : width(0), height(0) {}
+    Maze() :
+        width(0), height(0), pixels_hash(0), requested_layout(Layout::ROW_MAJOR), layout(Layout::ROW_MAJOR), tile_cols(0),
+        output_format(PathFormat::TEXT), types(nullptr), contracted(false), contracted_dists(false), classified(false),
+        masks_built(false), load_id(0), ws(&own_workspace) {}
+
+    Maze(Workspace& workspace) :
+        width(0), height(0), pixels_hash(0), requested_layout(Layout::ROW_MAJOR), layout(Layout::ROW_MAJOR), tile_cols(0),
+        output_format(PathFormat::TEXT), types(nullptr), contracted(false), contracted_dists(false), classified(false),
+        masks_built(false), load_id(0), ws(&workspace) {}
 
     Maze(const Bitmap_Image& bmp_img);
 
+    Maze(const Maze&) = delete;
+
+    Maze& operator=(const Maze&) = delete;
+
+    // Used from the next from_bmp or from_buffer. Pre-classified pixels given to from_buffer are always row by row.
+    void set_layout(Layout layout);
+
+    Layout get_layout() const;
+
+    // format of write_points and save_path, TEXT by default
+    void set_output_format(PathFormat format);
+
+    PathFormat get_output_format() const;
+
     void from_bmp(const std::string& filename);
 
     void from_bmp(const Bitmap_Image& bmp_img);
 
+    // Solves straight from the caller's pixels, without copying them. types, if given, is a caller-owned array of
+    // width * height pre-classified pixels, row by row; UNSET ones are classified in place on first visit.
+    // Separate Maze objects with separate workspaces can solve at the same time, sharing pixels read-only
+    // (and types too, if it has no UNSET pixels).
+    void from_buffer(const PixelBuffer& pixels, PixelType* types = nullptr);
+
+    // hash of the loaded pixels, pre-classified types given to from_buffer are assumed to match them
+    uint64_t get_hash() const;
+
     void find_path();
 
+    // Only UniformCost gets the bit-parallel BFS, see the cost models. Explicitly instantiated for GreyCost,
+    // UniformCost and LutCost
+    template<class CostModel>
+    void find_path(const CostModel& cost);
+
+    // Looks the maze and the cost model up in cache and runs find_path only if they aren't there. Returns true on
+    // a hit. After a miss the solution is from_search: its paths stay in the workspace, and save_solution traces
+    // them once, writing them out and packing them for cache in the same pass, so the result is stored only
+    // when it is saved. A hit doesn't search, so the solution is all there is: get_path, get_solution and
+    // save_path find no ENDs, use save_solution.
+    // Explicitly instantiated for GreyCost, UniformCost and LutCost.
+    template<class CostModel>
+    bool find_path_cached(ResultCache& cache, const CostModel& cost, Solution& solution);
+
+    // Same costs as find_path with every key set searched as a separate task on pool. A state only moves to
+    // a bigger key set, so the sets are searched in waves by their number of keys and the steps onto new keys
+    // are handed to the next wave through lock-free stacks. ENDs are listed wave by wave, so save_path may
+    // draw the paths in another order than after find_path. With more than 64 keys it runs find_path.
+    // Explicitly instantiated for GreyCost, UniformCost and LutCost.
+    void find_path_parallel(WorkPool& pool);
+
+    template<class CostModel>
+    void find_path_parallel(const CostModel& cost, WorkPool& pool);
+
+    // Costs between many sources and many targets, starting with no keys. One search per distinct source serves
+    // all targets and stops as soon as they are all settled. If there are fewer distinct targets than sources and
+    // the maze has no keys, the searches go backwards from the targets instead and each serves all sources. With
+    // keys every source still gets its own search. The searches have their own distance arrays in the workspace,
+    // so the result of the last find_path is kept (at the cost of a second set of them).
+    // Explicitly instantiated for GreyCost, UniformCost and LutCost.
+    BatchResult find_batch(const std::vector<Coord>& sources, const std::vector<Coord>& targets);
+
+    template<class CostModel>
+    BatchResult find_batch(const std::vector<Coord>& sources, const std::vector<Coord>& targets, const CostModel& cost);
+
+    // Path of one query of the batch, found again on demand. res.end is the target and res.path goes from the
+    // step before it back to the source, like get_path. The cost model must be the one of the batch.
+    PathResult batch_path(const BatchResult& batch, size_t source, size_t target);
+
+    template<class CostModel>
+    PathResult batch_path(const BatchResult& batch, size_t source, size_t target, const CostModel& cost);
+
+    // ARA*: the first path is the one with the fewest steps, found by the BFS before anything else is prepared,
+    // and its cost bounds the passes after it. Each pass has f = g + epsilon * h with epsilon halved down to 1 and
+    // goes on from the open list of the last one, while limits allow. Returns the best path found so far with its
+    // suboptimality bound, which an interrupted pass tightens too. h sums the cheapest step into every row and
+    // column between a pixel and the nearest END area, so it ignores keys and never overestimates.
+    // With the default epsilon 1 there is one A* pass after the BFS. On the example mazes a bigger epsilon only
+    // sends the first passes into dead ends that the last one has to expand again.
+    AnytimeResult find_path_anytime(const SearchLimits& limits, double epsilon = 1.0);
+
+    // Explicitly instantiated for GreyCost, UniformCost and LutCost
+    template<class CostModel>
+    AnytimeResult find_path_anytime(const SearchLimits& limits, const CostModel& cost, double epsilon = 1.0);
+
+    // Splits the maze into rectangles of one color. Inside a rectangle every step costs the same, so the search
+    // only needs its border pixels that touch other rectangles, its corners and the pixels straight across from
+    // them; one-pixel corridors become single edges. KEY and ZONE areas have their own rectangles, so keys are
+    // picked up and zones checked on the edges that enter them. A FREE stop with only two neighbours is a bend
+    // of a corridor: the search walks through it to the next stop instead of keeping it in the open list.
+    // Built once per maze.
+    void contract();
+
+    // Number of stops the search keeps in its open list, 0 before contract(). The noisy greys of the 620x439
+    // examples leave few rectangles above one pixel, so ~83k of 272k pixels stay, but find_path_contracted is
+    // still about a third faster than find_path. With keys it gains more: 5k of 90k pixels and 3.5 times faster
+    // with 8 keys. A maze of one-pixel corridors goes from 2.2M to 215k of 4.3M pixels with the corridor bends,
+    // yet there the search is slower than find_path, which needs no rectangles.
+    size_t contracted_nodes() const;
+
+    // HPA*: builds the clusters and their transition nodes and computes the costs between the nodes of every
+    // cluster under every subset of its keys. Kept until the next maze is loaded or another cost model is used.
+    // Explicitly instantiated for GreyCost, UniformCost and LutCost.
+    template<class CostModel>
+    void build_hierarchy(const CostModel& cost, size_t cluster_size = DEFAULT_CLUSTER_SIZE);
+
+    // number of nodes of the abstract graph, 0 before build_hierarchy()
+    size_t hierarchy_nodes() const;
+
+    // Searches the abstract graph, then refines every leg inside its cluster. Builds the hierarchy if needed.
+    // The cost has no guaranteed bound: paths only cross clusters at the transition pixels, so it can be above
+    // the one of find_path. On the examples it is within 1%, but on mazes with keys a detour for a key has to
+    // go through transitions too and it has been 15% above. Use find_path when the exact cost matters.
+    PathResult find_path_hierarchical();
+
+    template<class CostModel>
+    PathResult find_path_hierarchical(const CostModel& cost);
+
+    // Same costs as find_path, searched over the contracted graph. save_path and get_path expand the edges back
+    // into pixels. Explicitly instantiated for GreyCost, UniformCost and LutCost.
+    void find_path_contracted();
+
+    template<class CostModel>
+    void find_path_contracted(const CostModel& cost);
+
+    // Cost to reach any END from every pixel under every key set: one reverse multi-source search from all ENDs,
+    // supersets of keys first. Key sets no walk can hold are skipped. Explicitly instantiated for GreyCost,
+    // UniformCost and LutCost.
+    void build_exit_field(DistanceField& field);
+
+    template<class CostModel>
+    void build_exit_field(DistanceField& field, const CostModel& cost);
+
+    // build_exit_field, or the field saved in cache for this maze and cost model
+    template<class CostModel>
+    bool build_exit_field_cached(ResultCache& cache, DistanceField& field, const CostModel& cost);
+
+    // cost to exit when starting at c without keys, MAX_DIST if there is no way out
+    size_t exit_cost(const DistanceField& field, const Coord& c) const;
+
+    // path from c to the nearest END following the field down, empty if there is no way out
+    std::vector<Coord> exit_path(const DistanceField& field, const Coord& c) const;
+
+    // paints every pixel that can reach an END from blue (near) to red (far)
+    bool save_exit_heatmap(const DistanceField& field, Bitmap_Image& bmp_img, const std::string& filename) const;
+
+    // cheapest of the ENDs reached by the last find_path, with the path to it
+    PathResult get_path();
+
+    // all ENDs reached by the last find_path with the paths to them
+    Solution get_solution();
+
+    // writes the path in the output format, through a writer thread
+    void write_points(const std::vector<Coord>& path, std::ostream& out) const;
+
+    // writes to output.txt, output.rle or output.dvi
     void write_points(const std::vector<Coord>& path);
 
+    void paint_path(Bitmap_Image& bmp_img, const PathResult& res) const;
+
+    // Paths to every END, each written out while the next one is traced. With TEXT the corners of the paths
+    // one after another, as if they were one path.
     void save_path(Bitmap_Image& bmp_img);
+
+    void save_path(Bitmap_Image& bmp_img, const PathResult& res);
+
+    // Writes the same as save_path after the search that gave the solution. A solution from_search is traced
+    // and written end by end like save_path and stored in its cache from the same pass, so no other search may
+    // run in between.
+    void save_solution(Bitmap_Image& bmp_img, const Solution& solution);
 };
 
@@ -0,0 +1,219 @@
+#include "PathWriter.h"
+
+const size_t AsyncWriter::BUFFER_SIZE;
+const size_t AsyncWriter::MAX_PENDING;
+const uint32_t PathWriter::RLE_SIGNATURE;
+const uint32_t PathWriter::DELTA_SIGNATURE;
+const size_t PathWriter::MAX_RUN;
+const size_t PathWriter::NO_DIR;
+
+AsyncWriter::AsyncWriter(const std::string& filename, bool binary) :
+    file(filename, binary ? std::ios::trunc | std::ios::binary : std::ios::trunc), out(&file),
+    closing(false), failed(!file)
+{
+    filling.reserve(BUFFER_SIZE);
+    thread = std::thread(&AsyncWriter::work, this);
+}
+
+AsyncWriter::AsyncWriter(std::ostream& out) : out(&out), closing(false), failed(false) {
+    filling.reserve(BUFFER_SIZE);
+    thread = std::thread(&AsyncWriter::work, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+    close();
+}
+
+void AsyncWriter::hand_over() {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&]() { return pending.size() < MAX_PENDING; });
+    pending.push_back(std::move(filling));
+    guard.unlock();
+    changed.notify_all();
+
+    filling = std::string();
+    filling.reserve(BUFFER_SIZE);
+}
+
+void AsyncWriter::work() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        changed.wait(guard, [&]() { return closing || !pending.empty(); });
+        if (pending.empty()) return;
+
+        // пишем без заключване, за да може да се пълни следващият буфер
+        std::string buffer = std::move(pending.front());
+        pending.pop_front();
+        guard.unlock();
+        changed.notify_all();
+
+        out->write(buffer.data(), buffer.size());
+        bool ok = (bool)*out;
+
+        guard.lock();
+        if (!ok) failed = true;
+    }
+}
+
+void AsyncWriter::write(const char* data, size_t size) {
+    filling.append(data, size);
+    if (filling.size() >= BUFFER_SIZE) hand_over();
+}
+
+void AsyncWriter::put(char c) {
+    filling.push_back(c);
+    if (filling.size() >= BUFFER_SIZE) hand_over();
+}
+
+bool AsyncWriter::close() {
+    if (!thread.joinable()) return !failed;
+
+    if (!filling.empty()) hand_over();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+    }
+    changed.notify_all();
+    thread.join();
+
+    out->flush();
+    if (!*out) failed = true;
+    if (file.is_open()) file.close();
+    return !failed;
+}
+
+PathWriter::PathWriter(const std::string& filename, PathFormat format) :
+    format(format), out(filename, format != PathFormat::TEXT), count(0), prev_row(0), prev_col(0), curr_row(0),
+    curr_col(0), horizontal(false), run_dir(NO_DIR), run_length(0)
+{
+    write_header();
+}
+
+PathWriter::PathWriter(std::ostream& out, PathFormat format) :
+    format(format), out(out), count(0), prev_row(0), prev_col(0), curr_row(0), curr_col(0), horizontal(false),
+    run_dir(NO_DIR), run_length(0)
+{
+    write_header();
+}
+
+std::string PathWriter::file_name(PathFormat format) {
+    switch (format) {
+    case PathFormat::MOVES_RLE:
+        return "output.rle";
+    case PathFormat::DELTA_VARINT:
+        return "output.dvi";
+    default:
+        return "output.txt";
+    }
+}
+
+PathWriter::~PathWriter() {
+    close();
+}
+
+void PathWriter::write_header() {
+    if (format == PathFormat::TEXT) return;
+    uint32_t signature = format == PathFormat::MOVES_RLE ? RLE_SIGNATURE : DELTA_SIGNATURE;
+
+    // little-endian, независимо от машината
+    for (size_t i = 0; i < 4; i++) {
+        out.put(char((signature >> (8 * i)) & 0xFF));
+    }
+}
+
+void PathWriter::write_point(size_t row, size_t col) {
+    std::string line = std::to_string(row) + " " + std::to_string(col) + "\n";
+    out.write(line.data(), line.size());
+}
+
+void PathWriter::write_varint(uint64_t value) {
+    while (value >= 0x80) {
+        out.put(char((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.put(char(value));
+}
+
+// Same corners as the old write_points: a point is written when the path turns from along a row to along
+// a column or back, and the first and the last points are always written.
+void PathWriter::text_corner(size_t next_row, size_t next_col, bool last) {
+    if (last) write_point(curr_row, curr_col);
+
+    if (horizontal && curr_row != prev_row) {
+        if (!last && next_row != prev_row) {
+            write_point(curr_row, curr_col);
+            horizontal = !horizontal;
+        }
+    }
+    if (!horizontal && curr_col != prev_col) {
+        if (!last && next_col != prev_col) {
+            write_point(curr_row, curr_col);
+            horizontal = !horizontal;
+        }
+    }
+}
+
+void PathWriter::flush_run() {
+    if (run_length == 0) return;
+
+    out.put(char((run_dir << 6) | run_length));
+    run_length = 0;
+}
+
+void PathWriter::add(size_t row, size_t col) {
+    switch (format) {
+    case PathFormat::TEXT:
+        if (count == 0) write_point(row, col);
+        if (count >= 2) text_corner(row, col, false);
+        break;
+
+    case PathFormat::MOVES_RLE: {
+        if (count == 0) {
+            write_varint(row);
+            write_varint(col);
+            break;
+        }
+
+        size_t dir = NO_DIR;
+        if (col == curr_col && row + 1 == curr_row) dir = 0;
+        else if (col == curr_col && row == curr_row + 1) dir = 1;
+        else if (row == curr_row && col + 1 == curr_col) dir = 2;
+        else if (row == curr_row && col == curr_col + 1) dir = 3;
+
+        if (dir == NO_DIR) {
+            flush_run();
+            out.put(0);
+            write_varint(row);
+            write_varint(col);
+        }
+        else {
+            if (dir != run_dir || run_length == MAX_RUN) flush_run();
+            run_dir = dir;
+            run_length++;
+        }
+        break;
+    }
+
+    case PathFormat::DELTA_VARINT: {
+        int64_t d_row = int64_t(row) - int64_t(count == 0 ? 0 : curr_row);
+        int64_t d_col = int64_t(col) - int64_t(count == 0 ? 0 : curr_col);
+        write_varint((uint64_t(d_row) << 1) ^ uint64_t(d_row >> 63));
+        write_varint((uint64_t(d_col) << 1) ^ uint64_t(d_col >> 63));
+        break;
+    }
+    }
+
+    prev_row = curr_row;
+    prev_col = curr_col;
+    curr_row = row;
+    curr_col = col;
+    count++;
+}
+
+// safe to call again, the destructor does
+bool PathWriter::close() {
+    if (format == PathFormat::TEXT && count >= 2) text_corner(0, 0, true);
+    if (format == PathFormat::MOVES_RLE) flush_run();
+    count = 0;
+    return out.close();
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Buffered output written by a background thread. write() fills a buffer and hands the full ones over, so the
+// caller goes on while the earlier ones are written. At most MAX_PENDING buffers wait, then write() blocks.
+class AsyncWriter {
+private:
+    static const size_t BUFFER_SIZE = size_t(64) << 10;
+    static const size_t MAX_PENDING = 4;
+
+    std::ofstream file;
+    std::ostream* out;
+
+    std::string filling;
+    std::deque<std::string> pending;
+    std::mutex lock;
+    std::condition_variable changed;
+    bool closing;
+    bool failed;
+    std::thread thread;
+
+    void hand_over();
+
+    void work();
+
+public:
+    AsyncWriter(const std::string& filename, bool binary);
+
+    // writes to a caller-owned stream, which must outlive close()
+    AsyncWriter(std::ostream& out);
+
+    ~AsyncWriter();
+
+    AsyncWriter(const AsyncWriter&) = delete;
+
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    void write(const char* data, size_t size);
+
+    void put(char c);
+
+    // writes what is left and stops the thread, false if any write failed
+    bool close();
+};
+
+// TEXT - the corners of the path, "row col" per line.
+// MOVES_RLE - "MPR1", the first point as two varints, then one byte per run of up to 63 moves in one direction:
+// direction (up, down, left, right) in the high 2 bits and the length in the low 6. A zero byte is a jump to
+// the point in the next two varints, where the paths to two ends meet.
+// DELTA_VARINT - "MPD1", then every point as the zigzag varint differences of row and col from the previous
+// point (the first one from 0 0).
+enum class PathFormat : unsigned char {
+    TEXT,
+    MOVES_RLE,
+    DELTA_VARINT
+};
+
+// Encodes points as they come, so a path can be written while it is still being traced.
+class PathWriter {
+private:
+    static const uint32_t RLE_SIGNATURE = 0x3152504D; // "MPR1"
+    static const uint32_t DELTA_SIGNATURE = 0x3144504D; // "MPD1"
+    static const size_t MAX_RUN = 63;
+    static const size_t NO_DIR = -1;
+
+    PathFormat format;
+    AsyncWriter out;
+    size_t count;
+    size_t prev_row, prev_col;
+    size_t curr_row, curr_col;
+    bool horizontal; // TEXT: the path goes along a row since the last corner
+    size_t run_dir;
+    size_t run_length;
+
+    void write_header();
+
+    void write_point(size_t row, size_t col);
+
+    void write_varint(uint64_t value);
+
+    // TEXT: the current point knowing the one after it (last if there is none)
+    void text_corner(size_t next_row, size_t next_col, bool last);
+
+    void flush_run();
+
+public:
+    PathWriter(const std::string& filename, PathFormat format);
+
+    PathWriter(std::ostream& out, PathFormat format);
+
+    ~PathWriter();
+
+    PathWriter(const PathWriter&) = delete;
+
+    PathWriter& operator=(const PathWriter&) = delete;
+
+    // output.txt, output.rle or output.dvi
+    static std::string file_name(PathFormat format);
+
+    void add(size_t row, size_t col);
+
+    bool close();
+};
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// Allocation counters shared by all containers of one Maze::Workspace, and whether their big blocks
+// should be backed by huge pages.
+struct AllocStats {
+    size_t allocations;
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t huge_allocations;
+    bool huge_pages;
+
+    AllocStats() : allocations(0), live_bytes(0), peak_bytes(0), huge_allocations(0), huge_pages(false) {}
+
+    // start counting a new solve, the memory already held by the workspace stays live
+    void reset() {
+        allocations = 0;
+        huge_allocations = 0;
+        peak_bytes = live_bytes;
+    }
+};
+
+// std::allocator that records every allocation in an AllocStats.
+// Blocks of at least HUGE_PAGE_SIZE bytes are aligned to it, so they can be backed by huge pages.
+template<class T>
+class CountingAllocator {
+private:
+    template<class U> friend class CountingAllocator;
+
+    static const size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+    AllocStats* stats;
+
+    static bool is_big(size_t n) {
+        return n * sizeof(T) >= HUGE_PAGE_SIZE;
+    }
+
+    static size_t big_bytes(size_t n) {
+        return (n * sizeof(T) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+
+public:
+    using value_type = T;
+
+    CountingAllocator(AllocStats* stats = nullptr) : stats(stats) {}
+
+    template<class U>
+    CountingAllocator(const CountingAllocator<U>& other) : stats(other.stats) {}
+
+    T* allocate(size_t n) {
+        if (n > (size_t(PTRDIFF_MAX) - HUGE_PAGE_SIZE) / sizeof(T)) throw std::bad_alloc();
+
+        if (stats != nullptr) {
+            stats->allocations++;
+            stats->live_bytes += n * sizeof(T);
+            if (stats->live_bytes > stats->peak_bytes) stats->peak_bytes = stats->live_bytes;
+        }
+
+        // big blocks are always allocated this way, so freeing them doesn't depend on the flag
+        if (is_big(n)) {
+#if defined(_MSC_VER)
+            void* p = _aligned_malloc(big_bytes(n), HUGE_PAGE_SIZE);
+#else
+            void* p = std::aligned_alloc(HUGE_PAGE_SIZE, big_bytes(n));
+#endif
+            if (p == nullptr) throw std::bad_alloc();
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+            if (stats != nullptr && stats->huge_pages) {
+                madvise(p, big_bytes(n), MADV_HUGEPAGE);
+                stats->huge_allocations++;
+            }
+#endif
+            return static_cast<T*>(p);
+        }
+        return std::allocator<T>().allocate(n);
+    }
+
+    // resize(n) leaves plain values uninitialized like new T[n], so the pages nobody writes are never touched
+    template<class U>
+    void construct(U* p) {
+        ::new((void*)p) U;
+    }
+
+    template<class U, class... Args>
+    void construct(U* p, Args&&... args) {
+        ::new((void*)p) U(std::forward<Args>(args)...);
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (stats != nullptr) stats->live_bytes -= n * sizeof(T);
+
+        if (is_big(n)) {
+#if defined(_MSC_VER)
+            _aligned_free(p);
+#else
+            std::free(p);
+#endif
+            return;
+        }
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template<class U>
+    bool operator==(const CountingAllocator<U>& other) const {
+        return stats == other.stats;
+    }
+
+    template<class U>
+    bool operator!=(const CountingAllocator<U>& other) const {
+        return stats != other.stats;
+    }
+};
+
+template<class T>
+using PoolVector = std::vector<T, CountingAllocator<T>>;
+
+// FIFO over a ring buffer. clear() is O(1) and keeps the buffer, so a queue reused between solves
+// stops allocating once it has grown to the size of the largest wave.
+template<class T>
+class RingQueue {
+private:
+    PoolVector<T> ring;
+    size_t head;
+    size_t count;
+
+    void grow() {
+        PoolVector<T> bigger(ring.empty() ? 64 : ring.size() * 2, T(), ring.get_allocator());
+        for (size_t i = 0; i < count; i++) {
+            bigger[i] = ring[(head + i) % ring.size()];
+        }
+        ring.swap(bigger);
+        head = 0;
+    }
+
+public:
+    RingQueue(AllocStats* stats = nullptr) : ring(CountingAllocator<T>(stats)), head(0), count(0) {}
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    void push(const T& value) {
+        if (count == ring.size()) grow();
+        ring[(head + count) % ring.size()] = value;
+        count++;
+    }
+
+    T& front() {
+        return ring[head];
+    }
+
+    void pop() {
+        head = (head + 1) % ring.size();
+        count--;
+    }
+
+    void clear() {
+        head = 0;
+        count = 0;
+    }
+};
+
+// Stamps of a search state array: a state is marked if its stamp equals the stamp of the current search.
+// The stamps are zeroed a block at a time the first time one in the block is set, so a search that reaches
+// a small part of a big maze touches only the pages it uses.
+class StampArray {
+private:
+    static const size_t BLOCK_SHIFT = 10;
+
+    PoolVector<uint32_t> stamps;
+    PoolVector<unsigned char> ready; // the block of stamps is zeroed
+
+public:
+    StampArray(AllocStats* stats = nullptr) :
+        stamps(CountingAllocator<uint32_t>(stats)), ready(CountingAllocator<unsigned char>(stats)) {}
+
+    size_t size() const {
+        return stamps.size();
+    }
+
+    void resize(size_t n) {
+        stamps.resize(n);
+        ready.resize((n >> BLOCK_SHIFT) + 1, 0);
+    }
+
+    bool test(size_t indx, uint32_t stamp) const {
+        return indx < stamps.size() && ready[indx >> BLOCK_SHIFT] && stamps[indx] == stamp;
+    }
+
+    void set(size_t indx, uint32_t stamp) {
+        size_t block = indx >> BLOCK_SHIFT;
+        if (!ready[block]) {
+            size_t first = block << BLOCK_SHIFT;
+            size_t last = std::min(first + (size_t(1) << BLOCK_SHIFT), stamps.size());
+            std::fill(stamps.begin() + first, stamps.begin() + last, 0);
+            ready[block] = 1;
+        }
+        stamps[indx] = stamp;
+    }
+
+    // after the stamp counter wraps around, so the old stamps can't match again
+    void clear() {
+        std::fill(ready.begin(), ready.end(), 0);
+    }
+};
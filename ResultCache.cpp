@@ -0,0 +1,132 @@
+#include "ResultCache.h"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <random>
+
+const uint32_t ResultCache::FILE_SIGNATURE;
+
+static bool little_endian() {
+    const uint32_t one = 1;
+    return *(const unsigned char*)&one == 1;
+}
+
+// the files are little-endian, on other hosts the words are swapped on the way in and out
+static void to_file_order(uint32_t* words, size_t count) {
+    if (little_endian()) return;
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t w = words[i];
+        words[i] = (w >> 24) | ((w >> 8) & 0xFF00) | ((w << 8) & 0xFF0000) | (w << 24);
+    }
+}
+
+ResultCache::ResultCache(const std::string& dir) : dir(dir), hits(0), misses(0) {
+    std::error_code err;
+    std::filesystem::create_directories(dir, err);
+}
+
+std::string ResultCache::file_name(uint64_t key, const std::string& ext) const {
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << key << ext;
+    return (std::filesystem::path(dir) / name.str()).string();
+}
+
+std::string ResultCache::tmp_name(const std::string& name) const {
+    std::random_device rd;
+    std::ostringstream tmp;
+    tmp << name << "." << std::hex << rd() << rd() << ".tmp";
+    return tmp.str();
+}
+
+bool ResultCache::commit(const std::string& tmp_name, const std::string& name, bool written) const {
+    std::error_code err;
+    if (written) std::filesystem::rename(tmp_name, name, err);
+    if (!written || err) {
+        std::filesystem::remove(tmp_name, err);
+        return false;
+    }
+    return true;
+}
+
+bool ResultCache::load(uint64_t key, std::vector<uint32_t>& words) {
+    std::ifstream file(file_name(key, ".mrc"), std::ios::binary);
+
+    uint32_t header[4];
+    if (file) file.read((char*)header, sizeof(header));
+    to_file_order(header, 4);
+    if (!file || header[0] != FILE_SIGNATURE || header[1] != (uint32_t)key || header[2] != (uint32_t)(key >> 32)) {
+        misses++;
+        return false;
+    }
+
+    // a damaged count must not make us allocate more than the file holds
+    std::streampos pos = file.tellg();
+    file.seekg(0, std::ios::end);
+    uint64_t left = uint64_t(file.tellg() - pos);
+    file.seekg(pos);
+    if (left / sizeof(uint32_t) < header[3]) {
+        misses++;
+        return false;
+    }
+
+    words.resize(header[3]);
+    file.read((char*)words.data(), words.size() * sizeof(uint32_t));
+    if (!file) {
+        misses++;
+        return false;
+    }
+    to_file_order(words.data(), words.size());
+
+    hits++;
+    return true;
+}
+
+bool ResultCache::store(uint64_t key, const std::vector<uint32_t>& words) {
+    // временното име е случайно, за да не се смесват два записа на един ключ от различни процеси
+    std::string tmp = tmp_name(file_name(key, ".mrc"));
+
+    std::ofstream file(tmp, std::ios::trunc | std::ios::binary);
+    if (!file) return false;
+
+    uint32_t header[4] = { FILE_SIGNATURE, (uint32_t)key, (uint32_t)(key >> 32), (uint32_t)words.size() };
+    to_file_order(header, 4);
+    file.write((const char*)header, sizeof(header));
+    if (little_endian()) {
+        file.write((const char*)words.data(), words.size() * sizeof(uint32_t));
+    }
+    else {
+        std::vector<uint32_t> swapped(words);
+        to_file_order(swapped.data(), swapped.size());
+        file.write((const char*)swapped.data(), swapped.size() * sizeof(uint32_t));
+    }
+    file.close();
+
+    return commit(tmp, file_name(key, ".mrc"), (bool)file);
+}
+
+bool ResultCache::load_field(uint64_t key, DistanceField& field, size_t width, size_t height, size_t layers) {
+    if (!field.load(file_name(key, ".mdf"), width, height, layers)) {
+        misses++;
+        return false;
+    }
+
+    hits++;
+    return true;
+}
+
+bool ResultCache::store_field(uint64_t key, const DistanceField& field) {
+    std::string tmp = tmp_name(file_name(key, ".mdf"));
+
+    return commit(tmp, file_name(key, ".mdf"), field.save(tmp));
+}
+
+size_t ResultCache::get_hits() const {
+    return hits;
+}
+
+size_t ResultCache::get_misses() const {
+    return misses;
+}
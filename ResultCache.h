@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "DistanceField.h"
+
+// Results on disk, one file per key in dir. The key is a hash of the maze pixels and the solver options, so a
+// result is only read back for the same input. Files are written under a temporary name and renamed, so jobs
+// sharing the directory never read half of one.
+class ResultCache {
+private:
+    static const uint32_t FILE_SIGNATURE = 0x3143524D; // "MRC1"
+
+    std::string dir;
+    size_t hits, misses;
+
+    std::string file_name(uint64_t key, const std::string& ext) const;
+
+    std::string tmp_name(const std::string& name) const;
+
+    // moves the temporary file to its name if it was written whole, removes it otherwise
+    bool commit(const std::string& tmp_name, const std::string& name, bool written) const;
+
+public:
+    // creates dir if it doesn't exist
+    ResultCache(const std::string& dir);
+
+    // binary file: signature, key, number of words, words (all little-endian uint32, the key as two)
+    bool load(uint64_t key, std::vector<uint32_t>& words);
+
+    bool store(uint64_t key, const std::vector<uint32_t>& words);
+
+    // only a field of the given size is read, see DistanceField::load
+    bool load_field(uint64_t key, DistanceField& field, size_t width, size_t height, size_t layers);
+
+    bool store_field(uint64_t key, const DistanceField& field);
+
+    size_t get_hits() const;
+
+    size_t get_misses() const;
+};
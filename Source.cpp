@@ -15,17 +15,37 @@ const std::string FILE_NAME = "bmp_maze_examples\\00.input20x20.bmp"; // "input2
 #include "Bitmap.h"
 #include "Maze.h"
 
-int main() {
+int main(int argc, char** argv) {
     try {
+        // --cache DIR keeps the solutions in DIR, without it nothing is written besides the result
+        std::string cache_dir;
+        for (int i = 1; i + 1 < argc; i++) {
+            if (std::string(argv[i]) == "--cache") cache_dir = argv[++i];
+        }
+
         std::string file_name;
         std::cout << "Input file name: ";
         //std::cin >> file_name;
 
         Bitmap_Image img(FILE_NAME);
-        Maze maze;
+        Maze::Workspace workspace;
+        Maze maze(workspace);
         maze.from_bmp(img);
-        maze.find_path();
-        maze.save_path(img);
+
+        if (cache_dir.empty()) {
+            maze.find_path();
+            maze.save_path(img);
+        }
+        else {
+            // a maze solved before is written straight from the cache, a new one is traced end by end as it is written
+            ResultCache cache(cache_dir);
+            Maze::Solution solution;
+            if (maze.find_path_cached(cache, Maze::GreyCost(), solution)) std::cout << "Cached result.\n";
+            maze.save_solution(img, solution);
+        }
+
+        const AllocStats& stats = workspace.get_stats();
+        std::cout << "\nAllocations: " << stats.allocations << ", peak bytes: " << stats.peak_bytes << "\n";
     }
     catch (BitmapException& e) {
         std::cout << e.what() << "\n";
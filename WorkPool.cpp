@@ -0,0 +1,124 @@
+#include "WorkPool.h"
+
+WorkPool::WorkPool(size_t threads) : generation(0), stopping(false), pending(0), steals(0) {
+    if (threads == 0) threads = 1;
+
+    for (size_t i = 0; i < threads; i++) {
+        queues.emplace_back(new Queue());
+    }
+    for (size_t i = 0; i + 1 < threads; i++) {
+        this->threads.emplace_back(&WorkPool::work, this, i);
+    }
+}
+
+WorkPool::~WorkPool() {
+    {
+        std::lock_guard<std::mutex> guard(wake_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+}
+
+size_t WorkPool::get_threads() const {
+    return queues.size();
+}
+
+size_t WorkPool::get_steals() const {
+    return steals.load();
+}
+
+bool WorkPool::take(size_t self, std::function<void()>& task) {
+    {
+        Queue& own = *queues[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // крадем от началото, а собственикът взима от края, така рядко се борят за една задача
+    for (size_t i = 1; i < queues.size(); i++) {
+        Queue& other = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(other.lock);
+        if (!other.tasks.empty()) {
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool WorkPool::run_one(size_t self) {
+    std::function<void()> task;
+    if (!take(self, task)) return false;
+
+    try {
+        task();
+    }
+    catch (...) {
+        std::lock_guard<std::mutex> guard(error_lock);
+        if (!error) error = std::current_exception();
+    }
+
+    // под wake_lock, за да не се изпусне събуждането, ако run точно проверява pending
+    if (--pending == 0) {
+        std::lock_guard<std::mutex> guard(wake_lock);
+        done.notify_all();
+    }
+    return true;
+}
+
+void WorkPool::work(size_t self) {
+    size_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(wake_lock);
+            wake.wait(guard, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+
+        while (run_one(self)) {}
+    }
+}
+
+void WorkPool::run(std::vector<std::function<void()>>& tasks) {
+    if (tasks.empty()) return;
+
+    pending += tasks.size();
+    for (size_t i = 0; i < tasks.size(); i++) {
+        Queue& queue = *queues[i % queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(std::move(tasks[i]));
+    }
+    tasks.clear();
+
+    {
+        std::lock_guard<std::mutex> guard(wake_lock);
+        generation++;
+    }
+    wake.notify_all();
+
+    size_t self = queues.size() - 1;
+    while (run_one(self)) {}
+
+    {
+        std::unique_lock<std::mutex> guard(wake_lock);
+        done.wait(guard, [&]() { return pending.load() == 0; });
+    }
+
+    std::exception_ptr failed;
+    {
+        std::lock_guard<std::mutex> guard(error_lock);
+        std::swap(failed, error);
+    }
+    if (failed) std::rethrow_exception(failed);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Threads that run batches of tasks, kept between solves. Every thread (and the caller of run) has its own
+// deque: it takes tasks from the back of it and, when it's empty, steals from the front of the others.
+// Tasks are only added by run, so a thread that finds every deque empty sleeps until the next batch and the
+// caller sleeps until the last task is done.
+class WorkPool {
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues; // the last one is the caller's
+    std::vector<std::thread> threads;
+
+    std::mutex wake_lock;
+    std::condition_variable wake; // a new batch or stopping
+    std::condition_variable done; // pending reached 0
+    size_t generation;
+    bool stopping;
+
+    std::atomic<size_t> pending;
+    std::atomic<size_t> steals;
+
+    std::mutex error_lock;
+    std::exception_ptr error;
+
+    bool take(size_t self, std::function<void()>& task);
+
+    bool run_one(size_t self);
+
+    void work(size_t self);
+
+public:
+    // threads includes the caller of run, so 1 runs everything on the caller
+    WorkPool(size_t threads = std::thread::hardware_concurrency());
+
+    ~WorkPool();
+
+    WorkPool(const WorkPool&) = delete;
+
+    WorkPool& operator=(const WorkPool&) = delete;
+
+    size_t get_threads() const;
+
+    // tasks taken from another thread's deque since the pool was made
+    size_t get_steals() const;
+
+    // Runs the tasks and returns when all of them are done. The first exception of a task is rethrown here.
+    void run(std::vector<std::function<void()>>& tasks);
+};
+
+// Lock-free stack of batches: any thread pushes, one thread takes them all once the pushing is over.
+template<class T>
+class HandoffStack {
+private:
+    struct Node {
+        std::vector<T> items;
+        Node* next;
+    };
+
+    std::atomic<Node*> head;
+
+public:
+    HandoffStack() : head(nullptr) {}
+
+    ~HandoffStack() {
+        std::vector<T> rest;
+        take(rest);
+    }
+
+    HandoffStack(const HandoffStack&) = delete;
+
+    HandoffStack& operator=(const HandoffStack&) = delete;
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == nullptr;
+    }
+
+    void push(std::vector<T>&& items) {
+        Node* node = new Node{ std::move(items), head.load(std::memory_order_relaxed) };
+        while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    // appends every pushed item to out, in no particular order
+    void take(std::vector<T>& out) {
+        Node* node = head.exchange(nullptr, std::memory_order_acquire);
+        while (node != nullptr) {
+            out.insert(out.end(), node->items.begin(), node->items.end());
+            Node* next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+};